@@ -0,0 +1,442 @@
+// ffs_bench: runs the programs in bench/corpus on every execution engine
+// and reports compile time, throughput and peak memory as JSON, so two
+// builds can be compared (see --baseline).
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "compiler.h"
+#include "error.h"
+#include "ffs.h"
+#include "jit.h"
+#include "util.h"
+#include "version.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FFS_BENCH_FORK 1
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#else
+#define FFS_BENCH_FORK 0
+#endif
+
+#ifndef FFS_BENCH_CORPUS
+#define FFS_BENCH_CORPUS "bench/corpus"
+#endif
+
+#ifndef FFS_BENCH_BUILD_TYPE
+#define FFS_BENCH_BUILD_TYPE ""
+#endif
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    struct Benchmark {
+        const char *name;
+        std::size_t inputBytes; // generated text fed to ',' (0 = none)
+    };
+
+    // Classic heavy programs: arithmetic, deep call-like control flow, plain
+    // counting, byte-at-a-time I/O and nested jumps
+    const Benchmark CORPUS[] = {
+        {"mandelbrot", 0},
+        {"hanoi",      0},
+        {"counter",    0},
+        {"nesting",    0},
+        {"echo",       8 << 20},
+        {"rot13",      256 << 10}, // hundreds of steps per byte
+    };
+
+    struct EngineChoice {
+        const char *name;
+        Engine      engine;
+    };
+
+    const EngineChoice ENGINES[] = {
+        {"switch",   Engine::SWITCH},
+        {"threaded", Engine::THREADED},
+        {"jit",      Engine::JIT},
+    };
+
+    // One program on one engine. Fixed size so a forked child can hand it
+    // back through a pipe.
+    struct Sample {
+        double        compileMs  = 0; // median of the repeats
+        double        runMs      = 0; // median of the repeats
+        double        bestRunMs  = 0;
+        std::uint64_t ops        = 0; // VM instructions executed per run
+        std::uint64_t outputSize = 0;
+        long          peakRssKb  = -1;
+        char          error[256] = "";
+    };
+
+    double median (std::vector<double> v) {
+        std::sort(v.begin(), v.end());
+        return v.empty() ? 0 : v[v.size() / 2];
+    }
+
+    double ms_since (Clock::time_point t0) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+    }
+
+    // Printable text with a realistic mix of letters, spaces and newlines;
+    // the same every time so runs are comparable
+    std::vector<std::uint8_t> make_input (std::size_t size) {
+        static const char alphabet[] = "etaoinshrdlucmfwypvbgkqjxz ETAOINSHRDLU,.    ";
+        std::vector<std::uint8_t> text(size);
+        std::uint32_t             state = 0x9E3779B9u;
+        for (std::size_t i = 0; i < size; ++i) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            text[i] = i % 64 == 63 ? '\n' : static_cast<std::uint8_t>(alphabet[state % (sizeof(alphabet) - 1)]);
+        }
+        return text;
+    }
+
+    void fail (Sample &s, const std::string &what) {
+        std::snprintf(s.error, sizeof(s.error), "%s", what.c_str());
+    }
+
+    Sample measure (const std::string &src, const std::string &file, const Benchmark &bench, Engine engine, int repeat) {
+        Sample s;
+
+        std::vector<double> compileMs;
+        Program             prog;
+        for (int r = 0; r < repeat; ++r) {
+            auto t0 = Clock::now();
+            try {
+                prog = compile_src(src, 8, 8, file);
+            } catch (const ffs::Error &e) {
+                fail(s, e.info().message);
+                return s;
+            }
+            compileMs.push_back(ms_since(t0));
+        }
+        s.compileMs = median(compileMs);
+        // Counted runs set a step limit, which skips the compile-time prefix;
+        // dropping it here times the same instructions that were counted
+        prog.prefix = Prefix{};
+
+        std::vector<std::uint8_t> input = make_input(bench.inputBytes);
+        std::size_t               readPos = 0;
+        std::uint64_t             written = 0;
+
+        RunOptions opts;
+        opts.engine = engine;
+        ffs::Vm vm(opts);
+        vm.setOutput([&](const std::uint8_t *, std::size_t len) { written += len; });
+
+        auto runOnce = [&]() {
+            // A fresh source each time: the last one has already seen EOF
+            readPos = 0;
+            vm.setInput([&](std::uint8_t *buf, std::size_t cap) {
+                std::size_t n = std::min(cap, input.size() - readPos);
+                std::copy(input.begin() + readPos, input.begin() + readPos + n, buf);
+                readPos += n;
+                return n;
+            });
+            written = 0;
+            vm.reset();
+            return vm.run(prog);
+        };
+
+        // One counted run first: a limit nothing reaches makes the engines
+        // count instructions, at a cost the timed runs below do not pay
+        vm.setLimits(UINT64_MAX, 0);
+        ffs::Result counted = runOnce();
+        if (!counted.ok()) {
+            fail(s, counted.error->message);
+            return s;
+        }
+        s.ops        = counted.steps;
+        s.outputSize = written;
+
+        vm.setLimits(0, 0);
+        std::vector<double> runMs;
+        for (int r = 0; r < repeat; ++r) {
+            auto        t0     = Clock::now();
+            ffs::Result result = runOnce();
+            runMs.push_back(ms_since(t0));
+            if (!result.ok()) {
+                fail(s, result.error->message);
+                return s;
+            }
+        }
+        s.runMs     = median(runMs);
+        s.bestRunMs = *std::min_element(runMs.begin(), runMs.end());
+        return s;
+    }
+
+    // Each measurement runs in its own process where possible, so peak RSS
+    // belongs to that program and engine alone
+    Sample measure_isolated (const std::string &src, const std::string &file, const Benchmark &bench, Engine engine,
+                             int repeat) {
+#if FFS_BENCH_FORK
+        int fds[2];
+        if (pipe(fds) == 0) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(fds[0]);
+                Sample s = measure(src, file, bench, engine, repeat);
+                bool   ok = write(fds[1], &s, sizeof(s)) == static_cast<ssize_t>(sizeof(s));
+                _exit(ok ? 0 : 1);
+            }
+            close(fds[1]);
+            if (pid > 0) {
+                Sample        s;
+                bool          got = read(fds[0], &s, sizeof(s)) == static_cast<ssize_t>(sizeof(s));
+                int           status = 0;
+                struct rusage usage {};
+                wait4(pid, &status, 0, &usage);
+                close(fds[0]);
+                if (!got) {
+                    fail(s, "benchmark process died");
+                    return s;
+                }
+#ifdef __APPLE__
+                s.peakRssKb = usage.ru_maxrss / 1024; // bytes there, kilobytes elsewhere
+#else
+                s.peakRssKb = usage.ru_maxrss;
+#endif
+                return s;
+            }
+            close(fds[0]);
+        }
+#endif
+        return measure(src, file, bench, engine, repeat);
+    }
+
+    std::string json_escape (const std::string &s) {
+        std::string out;
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            } else {
+                out += c;
+            }
+        }
+        return out;
+    }
+
+    // Results are written one object per line, which keeps --baseline
+    // parsing down to finding keys within a line
+    std::string json_result (const std::string &program, const std::string &engine, const Sample &s) {
+        char buf[512];
+        if (s.error[0] != '\0') {
+            std::snprintf(buf, sizeof(buf), "{\"program\": \"%s\", \"engine\": \"%s\", \"error\": \"%s\"}",
+                          program.c_str(), engine.c_str(), json_escape(s.error).c_str());
+            return buf;
+        }
+        double secs = s.runMs / 1000.0;
+        std::snprintf(buf, sizeof(buf),
+                      "{\"program\": \"%s\", \"engine\": \"%s\", \"compile_ms\": %.3f, \"run_ms\": %.3f, "
+                      "\"best_run_ms\": %.3f, \"ops\": %llu, \"ops_per_sec\": %.0f, \"ns_per_op\": %.3f, "
+                      "\"output_bytes\": %llu, \"peak_rss_kb\": %ld}",
+                      program.c_str(), engine.c_str(), s.compileMs, s.runMs, s.bestRunMs,
+                      static_cast<unsigned long long>(s.ops), secs > 0 ? static_cast<double>(s.ops) / secs : 0.0,
+                      s.ops > 0 ? s.runMs * 1e6 / static_cast<double>(s.ops) : 0.0,
+                      static_cast<unsigned long long>(s.outputSize), s.peakRssKb);
+        return buf;
+    }
+
+    std::optional<std::string> json_string (const std::string &line, const std::string &key) {
+        std::string pat = "\"" + key + "\": \"";
+        std::size_t at  = line.find(pat);
+        if (at == std::string::npos) {
+            return std::nullopt;
+        }
+        at += pat.size();
+        return line.substr(at, line.find('"', at) - at);
+    }
+
+    std::optional<double> json_number (const std::string &line, const std::string &key) {
+        std::string pat = "\"" + key + "\": ";
+        std::size_t at  = line.find(pat);
+        if (at == std::string::npos) {
+            return std::nullopt;
+        }
+        return std::strtod(line.c_str() + at + pat.size(), nullptr);
+    }
+
+    // program/engine -> median run time from an earlier ffs_bench report
+    std::map<std::string, double> load_baseline (const std::string &path) {
+        std::ifstream in(path);
+        if (!in) {
+            ffs::ErrorReporter::ioError(ffs::ErrorCode::FILE_NOT_FOUND,
+                                        "Could not open baseline: " + path,
+                                        path,
+                                        "Pass a JSON report written by an earlier ffs_bench run");
+        }
+        std::map<std::string, double> runMs;
+        std::string                   line;
+        while (std::getline(in, line)) {
+            auto program = json_string(line, "program");
+            auto engine  = json_string(line, "engine");
+            auto ms      = json_number(line, "run_ms");
+            if (program && engine && ms) {
+                runMs[*program + "/" + *engine] = *ms;
+            }
+        }
+        return runMs;
+    }
+
+    bool selected (const std::vector<std::string> &only, const std::string &name) {
+        return only.empty() || std::find(only.begin(), only.end(), name) != only.end();
+    }
+}
+
+int main (int argc, char **argv) {
+    std::string              corpus = FFS_BENCH_CORPUS;
+    std::string              outPath;
+    std::string              baselinePath;
+    double                   tolerance = 10;
+    int                      repeat    = 3;
+    std::vector<std::string> programs;
+    std::vector<std::string> engines;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string a       = argv[i];
+        auto        needVal = [&]() {
+            if (i + 1 >= argc) {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::MISSING_ARGUMENT_VALUE,
+                                                  "Missing value for " + a,
+                                                  "Use --help to see available options");
+            }
+            return std::string(argv[++i]);
+        };
+        if (a == "--corpus") {
+            corpus = needVal();
+        } else if (a == "--out" || a == "-o") {
+            outPath = needVal();
+        } else if (a == "--program") {
+            programs.push_back(needVal());
+        } else if (a == "--engine") {
+            engines.push_back(needVal());
+        } else if (a == "--repeat") {
+            repeat = std::atoi(needVal().c_str());
+            if (repeat < 1 || repeat > 1000) {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::OUT_OF_RANGE,
+                                                  "--repeat must be between 1 and 1,000",
+                                                  "Try a value like --repeat 5");
+            }
+        } else if (a == "--baseline") {
+            baselinePath = needVal();
+        } else if (a == "--tolerance") {
+            tolerance = std::atof(needVal().c_str());
+            if (!(tolerance >= 0)) {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::OUT_OF_RANGE,
+                                                  "--tolerance must not be negative",
+                                                  "Try a value like --tolerance 10 (percent)");
+            }
+        } else if (a == "--help" || a == "-h") {
+            std::printf("Usage: %s [OPTIONS]\n\n"
+                        "Runs the benchmark corpus on every engine and prints a JSON report.\n\n"
+                        "Options:\n"
+                        "      --corpus <dir>    Directory holding the corpus programs\n"
+                        "                        (default: %s)\n"
+                        "      --program <name>  Only run this program (repeatable)\n"
+                        "      --engine <name>   Only use this engine: switch, threaded or jit (repeatable)\n"
+                        "      --repeat <n>      Timed runs per measurement, the median is reported (default: 3)\n"
+                        "  -o, --out <file>      Write the report to file instead of stdout\n"
+                        "      --baseline <file> Compare run times with an earlier report; exit 1 on regressions\n"
+                        "      --tolerance <pct> Slowdown allowed by --baseline (default: 10)\n",
+                        argv[0], FFS_BENCH_CORPUS);
+            return 0;
+        } else {
+            ffs::ErrorReporter::argumentError(ffs::ErrorCode::UNKNOWN_ARGUMENT,
+                                              "Unknown flag: " + a,
+                                              "Use --help to see available options");
+        }
+    }
+
+    std::map<std::string, double> baseline;
+    if (!baselinePath.empty()) {
+        baseline = load_baseline(baselinePath);
+    }
+
+    std::vector<std::string> results;
+    bool                     failed    = false;
+    bool                     regressed = false;
+    for (const Benchmark &bench : CORPUS) {
+        if (!selected(programs, bench.name)) {
+            continue;
+        }
+        std::string   file = corpus + "/" + bench.name + ".ffs";
+        std::ifstream in(file, std::ios::binary);
+        if (!in) {
+            ffs::ErrorReporter::ioError(ffs::ErrorCode::FILE_NOT_FOUND,
+                                        "Could not open corpus program: " + file,
+                                        file,
+                                        "Point --corpus at the bench/corpus directory");
+        }
+        std::string src = read_all(in);
+
+        for (const EngineChoice &engine : ENGINES) {
+            if (!selected(engines, engine.name) || (engine.engine == Engine::JIT && !jit_supported())) {
+                continue;
+            }
+            Sample s = measure_isolated(src, file, bench, engine.engine, repeat);
+            results.push_back(json_result(bench.name, engine.name, s));
+
+            std::string key = std::string(bench.name) + "/" + engine.name;
+            if (s.error[0] != '\0') {
+                std::fprintf(stderr, "%-20s failed: %s\n", key.c_str(), s.error);
+                failed = true;
+                continue;
+            }
+            std::fprintf(stderr, "%-20s %10.2f ms %8.3f ns/op %10.1f Mops/s %8ld KB",
+                         key.c_str(), s.runMs, s.ops > 0 ? s.runMs * 1e6 / static_cast<double>(s.ops) : 0.0,
+                         s.runMs > 0 ? static_cast<double>(s.ops) / s.runMs / 1000.0 : 0.0, s.peakRssKb);
+            auto old = baseline.find(key);
+            if (old != baseline.end() && old->second > 0) {
+                double change = (s.runMs / old->second - 1) * 100;
+                bool   slower = change > tolerance;
+                std::fprintf(stderr, "  %+6.1f%%%s", change, slower ? "  REGRESSION" : "");
+                regressed = regressed || slower;
+            }
+            std::fprintf(stderr, "\n");
+        }
+    }
+
+    std::ostringstream report;
+    report << "{\n"
+           << "  \"version\": \"" << ffs_version::VERSION_STRING << "\",\n"
+           << "  \"compiler_revision\": " << COMPILER_REVISION << ",\n"
+           << "  \"build_type\": \"" << json_escape(FFS_BENCH_BUILD_TYPE) << "\",\n"
+           << "  \"repeat\": " << repeat << ",\n"
+           << "  \"results\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        report << "    " << results[i] << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    report << "  ]\n}\n";
+
+    if (outPath.empty()) {
+        std::fputs(report.str().c_str(), stdout);
+    } else {
+        std::ofstream out(outPath, std::ios::binary);
+        if (!(out << report.str())) {
+            ffs::ErrorReporter::ioError(ffs::ErrorCode::FILE_WRITE_ERROR,
+                                        "Could not write report: " + outPath,
+                                        outPath,
+                                        "Check that the directory exists and is writable");
+        }
+    }
+    return failed || regressed ? 1 : 0;
+}
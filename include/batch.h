@@ -0,0 +1,13 @@
+#pragma once
+
+#include <string>
+
+#include "vm.h"
+
+// --batch: run every job in `manifest` on `threads` workers (0 = one per
+// core). A manifest line is `program input output`; `-` as input means no
+// input and as output discards it, `#` starts a comment. Each distinct
+// program is compiled once and shared read-only; every worker has its own
+// tape and buffered I/O. Failures are reported per job on stderr.
+// Returns 0 when every job succeeded and 1 otherwise.
+int run_batch (const std::string &manifest, const RunOptions &opts, unsigned threads, const std::string &cacheDir);
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// Step and wall-clock limits for one run, and the --checkpoint-every
+// cadence. Engines keep their own step counter and only compare it against
+// next() on loop back-edges; check() is the cold path that enforces the
+// limits and schedules the next look.
+class Budget {
+    public:
+        Budget (std::uint64_t maxSteps, double timeoutSeconds, std::uint64_t snapshotSteps = 0,
+                double snapshotSeconds = 0);
+
+        // False when nothing is set, so engines can drop all counting
+        bool enabled () const {
+            return maxSteps != 0 || timed || snapshotSteps != 0;
+        }
+
+        std::uint64_t next () const {
+            return nextCheck;
+        }
+
+        // Called once the step counter has passed next(). Throws ffs::Error
+        // when a limit has been hit; returns true when a checkpoint is due.
+        bool check (std::uint64_t steps);
+
+        // Engines report their final count here when a run completes
+        void finish (std::uint64_t steps) {
+            finalSteps = steps;
+        }
+
+        // Instructions the finished run executed (0 unless enabled())
+        std::uint64_t used () const {
+            return finalSteps;
+        }
+
+    private:
+        // How many steps may pass between clock reads when only a timeout is set
+        static constexpr std::uint64_t POLL_INTERVAL = 1u << 20;
+
+        void schedule (std::uint64_t steps);
+
+        std::uint64_t                         maxSteps;
+        double                                timeoutSeconds;
+        std::uint64_t                         snapshotSteps;
+        double                                snapshotSeconds;
+        bool                                  timed; // the clock needs reading
+        std::chrono::steady_clock::time_point deadline;
+        std::uint64_t                         nextSnapshot = 0; // step count of the next checkpoint
+        std::chrono::steady_clock::time_point snapshotAt;       // time of the next checkpoint
+        std::uint64_t                         nextCheck  = 0;
+        std::uint64_t                         finalSteps = 0;
+};
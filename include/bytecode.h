@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <optional>
+#include <string>
+
+#include "program.h"
+
+// .ffsc: a linked, optimized Program on disk. Instructions are stored in
+// their in-memory layout, so loading is a mapping, a bounds check and one
+// copy - no lexing, desugaring or linking.
+//
+//   magic "FFSC", u32 format, u64 compiler key, u64 source key,
+//   u32 instruction count, u32 label count, u32 position count,
+//   u32 cell bits, count x 12-byte Instr, then per label: i32 pc,
+//   u32 length, name bytes, then per position: i32 pc, u32 line, u32 column,
+//   then the prefix: u32 entry, u32 ptr, u32 span, u32 cell count, that
+//   many u32 cells, u32 output length, output bytes
+//
+// All integers are little-endian.
+
+// Identifies the compiler that produced a file; files from another build
+// are rejected
+std::uint64_t compiler_key ();
+
+// Cache key for a source text compiled with the given options
+std::uint64_t source_key (const std::string &src, int dbgWidth, int cellBits);
+
+// True when the file at `path` starts with the .ffsc magic
+bool is_bytecode_file (const std::string &path);
+
+// Write p to `path`, atomically replacing any existing file. Returns false
+// on I/O failure.
+bool save_bytecode (const Program &p, std::uint64_t sourceKey, const std::string &path);
+
+// compile_src through an on-disk cache of .ffsc files in cacheDir (none
+// when empty). Cache problems are never fatal; the source is just compiled.
+Program compile_cached (const std::string &src, const std::string &filename, int dbgWidth, int cellBits,
+                        const std::string &cacheDir);
+
+// The same, compiling straight from `in` without holding the source in
+// memory; the source key is stored through sourceKey when given
+Program compile_cached (std::istream &in, const std::string &filename, int dbgWidth, int cellBits,
+                        const std::string &cacheDir, std::uint64_t *sourceKey = nullptr);
+
+// Load `path`, or nothing when it is missing, damaged, from another
+// compiler, or (if sourceKey is given) built from different source
+std::optional<Program> load_bytecode (const std::string &path, std::optional<std::uint64_t> sourceKey = std::nullopt);
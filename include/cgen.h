@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+#include "program.h"
+#include "vm.h"
+
+// Translate p into a self-contained C program. The tape options in opts
+// (size, growth limit, clamp/strict/elastic, '!' width) are fixed in the
+// generated code; step limits, timeouts, tracing and profiling are not
+// carried over. Cells wrap at p.cellBits and ',' stores all ones on EOF,
+// as in the VM. `source` is only mentioned in the header comment.
+std::string emit_c (const Program &p, const RunOptions &opts, const std::string &source = "");
+
+// Compile the C file at cPath into the executable exePath with the system
+// C compiler ($CC, or cc when unset). Returns the compiler's exit status.
+int build_native (const std::string &cPath, const std::string &exePath);
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "iobuf.h"
+#include "program.h"
+#include "tape.h"
+
+// --checkpoint snapshots: everything a run needs to carry on later, taken
+// on a loop back-edge. The tape is stored as runs of cells that are not
+// all zero, so a sparse tape costs little however long it is.
+//
+//   magic "FFSK", u32 format, u64 program key, u32 cell bits, u32 reserved,
+//   u64 pc, u64 tape length, u64 home index, u64 pointer index,
+//   u64 input offset, u64 output offset, u64 output origin (where the
+//   output began in its file), u64 run count, then per run:
+//   u64 first index, u64 cell count, that many cells
+//
+// Integers and cells are in native byte order; snapshots are meant to be
+// resumed on the machine that took them.
+
+// Identifies a linked program, so a snapshot is never resumed under
+// different code
+std::uint64_t program_key (const Program &p);
+
+// Writes snapshots of one run to `path`, each atomically replacing the
+// last. On POSIX systems the writing happens in a forked child, which sees
+// a copy-on-write image of the tape, so the run only pauses for the fork;
+// a snapshot that comes due while the previous one is still being written
+// is skipped. Failures are reported and never stop the run.
+class Checkpointer {
+    public:
+        Checkpointer (const Program &p, const std::string &path);
+
+        // Waits for a snapshot still being written
+        ~Checkpointer ();
+
+        Checkpointer (const Checkpointer &) = delete;
+
+        Checkpointer &operator= (const Checkpointer &) = delete;
+
+        // Snapshot a run that would carry on at `pc`. Program output is
+        // flushed first so the recorded output offset is on disk.
+        void take (std::size_t pc, std::size_t ptr, const Tape &tape, const InputSource &in, OutputBuffer &out);
+
+    private:
+        // True when no snapshot is being written any more
+        bool settle (bool wait);
+
+        std::uint64_t key;
+        int           cellBits;
+        std::string   path;
+        std::string   temp;
+        long          child = 0; // pid of the writer, 0 when idle
+};
+
+// Where a resumed run carries on
+struct Resume {
+    std::size_t   pc     = 0;
+    std::size_t   ptr    = 0;
+    std::uint64_t input  = 0; // bytes of input the run had consumed
+    std::uint64_t output = 0; // bytes of output it had written
+    std::uint64_t origin = 0; // where that output began in its file
+};
+
+// Load the snapshot at `path` onto tape. Throws ffs::Error when the file is
+// unreadable, was taken for another program or cell width, or does not fit
+// the tape options.
+Resume load_checkpoint (const std::string &path, const Program &p, Tape &tape);
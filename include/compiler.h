@@ -1,7 +1,25 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
 #include <string>
 
 #include "program.h"
 
-Program compile_src(const std::string &raw, int dbgWidth, const std::string &filename = "");
+// Bumped whenever compile_src starts producing different code for the same
+// source, so cached bytecode from older builds is not reused
+constexpr std::uint32_t COMPILER_REVISION = 6;
+
+// Called with each chunk of source text as compile_stream reads it
+using SourceTap = std::function<void (const char *data, std::size_t size)>;
+
+// Compile for cells of cellBits (8, 16 or 32) bits: counts fold modulo the
+// cell size and '=' accepts any value a cell holds
+Program compile_src(const std::string &raw, int dbgWidth, int cellBits, const std::string &filename = "");
+
+// Same code as compile_src, read from `in` through a fixed-size window so a
+// huge source is never held in memory as a whole
+Program compile_stream(std::istream &in, int dbgWidth, int cellBits, const std::string &filename = "",
+                       const SourceTap &tap = nullptr);
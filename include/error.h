@@ -2,6 +2,7 @@
 
 #include <string>
 #include <optional>
+#include <stdexcept>
 
 namespace ffs {
     // Error categories for better organization
@@ -26,10 +27,13 @@ namespace ffs {
         POINTER_UNDERFLOW,
         MEMORY_LIMIT_EXCEEDED,
         INVALID_JUMP_TARGET,
+        STEP_LIMIT_EXCEEDED,
+        TIMEOUT,
 
         // IO errors
         FILE_NOT_FOUND,
         FILE_READ_ERROR,
+        FILE_WRITE_ERROR,
 
         // Argument errors
         INVALID_ARGUMENT_VALUE,
@@ -72,16 +76,38 @@ namespace ffs {
         }
     };
 
+    // Carries an ErrorInfo up to a caller that has to clean up (e.g. flush
+    // buffered program output) before the error is reported, or that is
+    // embedding FFS and must not exit at all
+    class Error : public std::runtime_error {
+        public:
+            explicit Error (const ErrorInfo &info) : std::runtime_error(info.message), info_(info) {
+            }
+
+            const ErrorInfo &info () const {
+                return info_;
+            }
+
+        private:
+            ErrorInfo info_;
+    };
+
     // User-friendly error reporting
     class ErrorReporter {
         public:
             // Report an error and exit
             [[noreturn]] static void fatal (const ErrorInfo &error);
 
+            // Report an error and carry on (e.g. one failed job of many)
+            static void printError (const ErrorInfo &error);
+
             // Report an error with just a message (legacy compatibility)
             [[noreturn]] static void fatal (const std::string &message);
 
-            // Create specific error types with helpful context
+            // Create specific error types with helpful context. Syntax and
+            // runtime errors are thrown as ffs::Error rather than reported on
+            // the spot, so library users get them back as values; the CLI
+            // reports them once the program's output has been flushed.
             [[noreturn]] static void syntaxError (ErrorCode             code, const std::string &message,
                                                   const SourceLocation &loc        = {},
                                                   const std::string &   suggestion = "");
@@ -98,8 +124,6 @@ namespace ffs {
                                               const std::string &suggestion = "");
 
         private:
-            static void printError (const ErrorInfo &error);
-
             static std::string getErrorCodeName (ErrorCode code);
 
             static std::string getCategoryName (ErrorCategory category);
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "error.h"
+#include "iobuf.h"
+#include "program.h"
+#include "tape.h"
+#include "vm.h"
+
+namespace ffs {
+    // Outcome of one Vm::run. On failure `error` says what went wrong and
+    // `status` is 1, the exit status the CLI would have used.
+    struct Result {
+        int                      status = 0;
+        std::optional<ErrorInfo> error;
+        std::uint64_t            steps  = 0; // instructions executed; only counted under setLimits
+
+        bool ok () const {
+            return !error.has_value();
+        }
+    };
+
+    // Embeddable interpreter. The tape, streams and limits outlive a single
+    // run, so running many small programs costs nothing per run beyond
+    // compiling them. Errors come back in the Result: nothing is printed and
+    // the process never exits.
+    //
+    // Runs start at the home cell but keep whatever the previous run left
+    // on the tape; call reset() in between for a clean slate.
+    class Vm {
+        public:
+            explicit Vm (const RunOptions &opts = {});
+
+            Vm (const Vm &) = delete;
+
+            Vm &operator= (const Vm &) = delete;
+
+            // Program input and output, stdin and stdout until replaced.
+            // Replacing the input drops anything read ahead from the old one.
+            // A seekable FILE is read from its current stdio position and
+            // left just past the consumed bytes after each run, so the caller
+            // may read or seek it in between; a pipe or terminal must not be
+            // read through stdio while the Vm uses it.
+            void setInput (FILE *in);
+
+            void setInput (InputFeed feed);
+
+            void setOutput (FILE *out);
+
+            void setOutput (OutputSink sink);
+
+            // Where '!' and the --profile report write (stderr by default)
+            void setDebugStream (FILE *err);
+
+            // 0 means unlimited; the timeout counts from the start of each run
+            void setLimits (std::uint64_t maxSteps, double timeoutSeconds);
+
+            Result run (const Program &p);
+
+            // Compile `src` and run it; syntax errors come back in the Result
+            Result run (const std::string &src, const std::string &filename = "");
+
+            // Clear the tape and shrink it back to its starting size
+            void reset ();
+
+            const Tape &tape () const {
+                return memory;
+            }
+
+        private:
+            RunOptions                    opts;
+            Tape                          memory;
+            std::unique_ptr<InputSource>  in;
+            std::unique_ptr<OutputBuffer> out;
+            FILE *                        err = stderr;
+    };
+} // namespace ffs
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+
+// When buffered program output is pushed to the underlying stream.
+// AUTO picks LINE for terminals and BLOCK for everything else.
+enum class FlushMode {
+    AUTO,
+    LINE,
+    BLOCK,
+    NONE
+};
+
+// Embedders' replacements for stdio. A sink receives output in blocks; a
+// feed fills `buf` with up to `cap` bytes and returns 0 at end of input.
+using OutputSink = std::function<void (const std::uint8_t *data, std::size_t len)>;
+using InputFeed  = std::function<std::size_t (std::uint8_t *buf, std::size_t cap)>;
+
+// Program output ('.') collected in a private buffer and handed to stdio in
+// large blocks, so the VM never pays a locked fputc per byte
+class OutputBuffer {
+    public:
+        OutputBuffer (FILE *out, FlushMode mode);
+
+        // AUTO means BLOCK here, there being no terminal to look at
+        OutputBuffer (OutputSink sink, FlushMode mode);
+
+        ~OutputBuffer ();
+
+        OutputBuffer (const OutputBuffer &) = delete;
+
+        OutputBuffer &operator= (const OutputBuffer &) = delete;
+
+        // Write `count` copies of `byte`
+        void put (std::uint8_t byte, int count) {
+            if (count == 1 && len < CAPACITY) {
+                buf[len++] = byte;
+            } else {
+                putSlow(byte, count);
+            }
+            if (mode != FlushMode::BLOCK && (mode == FlushMode::NONE || byte == '\n')) {
+                flush();
+            }
+        }
+
+        // Push everything buffered so far all the way to the stream
+        void flush ();
+
+        // Bytes written since construction, buffered ones included
+        std::uint64_t written () const {
+            return total + len;
+        }
+
+        // Where in a regular file the first byte went (its end, for a
+        // file opened to append); 0 for other streams
+        std::uint64_t origin () const {
+            return start;
+        }
+
+        // For --resume: continue the output that began at `origin` as if
+        // `offset` bytes had been written. A regular file that reaches past
+        // origin + offset is cut back to it, dropping what a run wrote after
+        // its checkpoint and keeping what came before the run; other streams
+        // just carry on.
+        void resumeAt (std::uint64_t origin, std::uint64_t offset);
+
+    private:
+        static constexpr std::size_t CAPACITY = 64 * 1024;
+
+        void putSlow (std::uint8_t byte, int count);
+
+        void drain ();
+
+        FILE *                          out = nullptr;
+        OutputSink                      sink;
+        FlushMode                       mode;
+        std::unique_ptr<std::uint8_t[]> buf;
+        std::size_t                     len = 0;
+        std::uint64_t                   total = 0; // bytes drained so far
+        std::uint64_t                   start = 0; // see origin()
+};
+
+// Program input (',') served from a cursor instead of a locked fgetc per
+// byte. Regular files are memory-mapped where the platform allows it;
+// pipes and terminals are read in large chunks as data arrives.
+class InputSource {
+    public:
+        explicit InputSource (FILE *in);
+
+        explicit InputSource (InputFeed feed);
+
+        ~InputSource ();
+
+        InputSource (const InputSource &) = delete;
+
+        InputSource &operator= (const InputSource &) = delete;
+
+        // Consume `count` bytes and return the last one, or EOF if the input
+        // ran out first (matching `count` successive fgetc calls)
+        int get (int count) {
+            if (count == 1 && cur < end) {
+                return *cur++;
+            }
+            return getSlow(count);
+        }
+
+        // Bytes consumed since construction
+        std::uint64_t consumed () const {
+            return before + static_cast<std::uint64_t>(cur - window);
+        }
+
+        // Consume and discard n bytes, for --resume
+        void skip (std::uint64_t n);
+
+        // Move a seekable FILE to the first byte not consumed, so stdio
+        // reads carry on from there. Also done on destruction.
+        void sync ();
+
+        // Pick up a seekable FILE from wherever stdio reads or seeks left
+        // it since the last sync()
+        void rebase ();
+
+        // Terminal input: output should be flushed before blocking on it
+        bool interactive () const {
+            return tty;
+        }
+
+    private:
+        static constexpr std::size_t CHUNK = 64 * 1024;
+
+        int getSlow (int count);
+
+        bool refill ();
+
+        int                             fd  = -1;
+        FILE *                          file = nullptr;
+        bool                            seekable = false;
+        std::int64_t                    start    = 0; // stream position where consumed() counts from
+        InputFeed                       feed;
+        bool                            tty = false;
+        bool                            eof    = false;
+        const std::uint8_t *            cur    = nullptr;
+        const std::uint8_t *            end    = nullptr;
+        const std::uint8_t *            window = nullptr; // where cur started in the current buffer
+        std::uint64_t                   before = 0;       // bytes consumed from earlier buffers
+        void *                          map    = nullptr; // whole-file mapping, if any
+        std::size_t                     mapLen = 0;
+        std::unique_ptr<std::uint8_t[]> chunk;
+};
+
+// True when `f` is attached to a terminal
+bool is_interactive (FILE *f);
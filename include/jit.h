@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <optional>
+
+#include "budget.h"
+#include "iobuf.h"
+#include "program.h"
+#include "tape.h"
+#include "vm.h"
+
+// True when this build can generate native code for the host
+// (x86-64 with the System V calling convention)
+bool jit_supported ();
+
+// Translate p to machine code and run it with the same semantics as the
+// interpreter. Returns nothing when executable memory could not be set up,
+// in which case the caller should interpret the program instead.
+// Runtime errors are rethrown as ffs::Error once the native frames are gone.
+// The run begins at pc `entry` with the pointer at tape index `ptr`.
+std::optional<int> run_jit (const Program &p, const RunOptions &opts, Tape &tape, Budget &budget, InputSource &in, OutputBuffer &out, FILE *file_err,
+                            std::size_t entry, std::size_t ptr);
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "program.h"
+
+// Run the start of a linked program at compile time, up to its first ','
+// or '!' or a step budget, and record the state reached in p.prefix. The
+// walk stops short of anything whose result could depend on run-time
+// options: it never moves left of the home cell, and how far right it went
+// is kept in the prefix so runs on smaller tapes start from scratch.
+void evaluate_prefix (Program &p);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "program.h"
+
+// --profile output, from per-pc execution counts gathered by the
+// interpreter. A hot-loop table goes to `report`. Folded stacks go to
+// `foldedPath`, one "main;outer;inner count" line per loop nesting, for
+// flamegraph.pl, inferno or speedscope. Loops are named by their
+// [@label where they have one and located by line:column.
+void write_profile (const Program &p, const std::vector<std::uint64_t> &hits, FILE *report,
+                    const std::string &foldedPath);
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
-enum class Op {
+enum class Op : std::uint8_t {
     INC_PTR,
     DEC_PTR,
     INC,
@@ -14,15 +17,70 @@ enum class Op {
     JNZ,
     ZERO_IF_EOF,
     DBG,
-    CLEAR
+    CLEAR,
+    MUL_ADD, // cell[ptr + offset] += cell[ptr] * arg
+    SCAN,    // while cell != 0: ptr += arg
+    SET,     // cell = arg
+    GUARD    // if ptr + offset is off the tape: jump to the JZ at arg
 };
 
+constexpr std::size_t OP_COUNT = static_cast<std::size_t>(Op::GUARD) + 1;
+
+// Mnemonic used by trace-dump and other tools
+inline const char *op_name (Op op) {
+    static const char *const names[] = {"INC_PTR", "DEC_PTR", "INC", "DEC", "OUT", "IN", "JZ",
+                                        "JNZ", "ZERO_IF_EOF", "DBG", "CLEAR", "MUL_ADD", "SCAN", "SET", "GUARD"};
+    static_assert(sizeof(names) / sizeof(names[0]) == OP_COUNT, "op names out of sync with Op");
+    return names[static_cast<std::size_t>(op)];
+}
+
+// One executed instruction. Deliberately small and free of owning members
+// so the VM walks a dense array; everything that only matters for
+// diagnostics lives in DebugInfo.
+//
+// INC, DEC, OUT, IN and ZERO_IF_EOF act on cell[ptr + offset], which lets
+// balanced loop bodies run without moving the pointer. MUL_ADD reads
+// cell[ptr] and writes cell[ptr + offset].
+//
+// Rewritten loops whose body walks away from the loop cell are preceded by
+// a GUARD per end of that walk and followed by the loop as written. Moves
+// that reach an edge clamp, grow or fail one at a time, which the
+// rewritten form cannot mirror, so near an edge the original loop runs
+// instead; otherwise it is entered on a zero cell and skipped.
 struct Instr {
-    Op          op;
-    int         arg = 1;
-    std::string label;
+    Op           op;
+    std::int32_t arg    = 1;
+    std::int32_t offset = 0;
+};
+
+static_assert(sizeof(Instr) == 12, "Instr should stay a compact 12-byte record");
+
+// A place in the original source, 1-based (0 = unknown)
+struct SourcePos {
+    std::uint32_t line   = 0;
+    std::uint32_t column = 0;
+};
+
+// Side table for diagnostics, keyed by pc
+struct DebugInfo {
+    std::unordered_map<std::int32_t, std::string> labels;    // labelled JZ/JNZ -> loop name
+    std::unordered_map<std::int32_t, SourcePos>   positions; // JZ/JNZ -> its bracket in the source
+};
+
+// The state the start of a program reaches before it first reads input,
+// worked out at compile time (see prefix.h). A run on a fresh tape with
+// at least `span` cells right of home begins here instead of at pc 0.
+struct Prefix {
+    std::uint32_t              entry = 0; // pc the run continues from
+    std::uint32_t              ptr   = 0; // pointer position, from the home cell
+    std::uint32_t              span  = 0; // cells the prefix reached, from the home cell
+    std::vector<std::uint32_t> cells;     // tape from the home cell; the rest is zero
+    std::string                output;    // bytes the prefix printed
 };
 
 struct Program {
     std::vector<Instr> code;
+    DebugInfo          debug;
+    int                cellBits = 8; // cell width the code was compiled for
+    Prefix             prefix;
 };
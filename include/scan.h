@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Searches for the zero cell a scan loop ('[>]', '[<<]', ...) stops on,
+// comparing a whole vector of cells at a time. The widest kernel the CPU
+// supports is picked on first use; all of them find the same cell a walk
+// one stride at a time would. Strides must be at least 1. Wider cells are
+// walked one stride at a time.
+
+constexpr std::size_t NO_ZERO = SIZE_MAX;
+
+// First zero among cells[from], cells[from + stride], ... below `end`, or
+// NO_ZERO when there is none
+std::size_t find_zero_right (const std::uint8_t *cells, std::size_t from, std::size_t end, std::size_t stride);
+
+// First zero among cells[from], cells[from - stride], ... down to cells[0],
+// or NO_ZERO when there is none
+std::size_t find_zero_left (const std::uint8_t *cells, std::size_t from, std::size_t stride);
+
+std::size_t find_zero_right (const std::uint16_t *cells, std::size_t from, std::size_t end, std::size_t stride);
+
+std::size_t find_zero_left (const std::uint16_t *cells, std::size_t from, std::size_t stride);
+
+std::size_t find_zero_right (const std::uint32_t *cells, std::size_t from, std::size_t end, std::size_t stride);
+
+std::size_t find_zero_left (const std::uint32_t *cells, std::size_t from, std::size_t stride);
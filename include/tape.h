@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// The VM's memory: a contiguous tape of 8-, 16- or 32-bit cells plus the
+// clamp/strict/elastic rules for moving over it. Shared by every execution
+// engine so they agree on edge behaviour. Positions and sizes count cells;
+// data() is the raw storage, cellBits() / 8 bytes per cell.
+//
+// Elastic tapes grow in both directions up to maxCells without copying:
+// address space for the whole limit is reserved up front and committed as
+// the pointer reaches it, so untouched cells cost nothing. Growing leftward
+// shifts indices, so the pointer is passed by reference to anything that
+// may grow the tape and data() must be reloaded afterwards.
+class Tape {
+    public:
+        Tape (std::size_t cells, std::size_t maxCells, bool elastic, bool strict, int cellBits = 8);
+
+        ~Tape ();
+
+        Tape (const Tape &) = delete;
+
+        Tape &operator= (const Tape &) = delete;
+
+        std::uint8_t *data () {
+            return cells;
+        }
+
+        const std::uint8_t *data () const {
+            return cells;
+        }
+
+        std::size_t size () const {
+            return length;
+        }
+
+        int cellBits () const {
+            return static_cast<int>(cellSize * 8);
+        }
+
+        // Value of cell i, whatever the width
+        std::uint32_t cell (std::size_t i) const {
+            switch (cellSize) {
+                case 1:
+                    return cells[i];
+                case 2:
+                    return reinterpret_cast<const std::uint16_t *>(cells)[i];
+                default:
+                    return reinterpret_cast<const std::uint32_t *>(cells)[i];
+            }
+        }
+
+        // Store value in cell i, truncated to the cell width
+        void setCell (std::size_t i, std::uint32_t value) {
+            switch (cellSize) {
+                case 1:
+                    cells[i] = static_cast<std::uint8_t>(value);
+                    break;
+                case 2:
+                    reinterpret_cast<std::uint16_t *>(cells)[i] = static_cast<std::uint16_t>(value);
+                    break;
+                default:
+                    reinterpret_cast<std::uint32_t *>(cells)[i] = value;
+                    break;
+            }
+        }
+
+        // True until a run starts on the tape, and again after reset(): the
+        // tape is all zero with the pointer home
+        bool fresh () const {
+            return unused;
+        }
+
+        void markUsed () {
+            unused = false;
+        }
+
+        // Index of the starting cell, where every run begins
+        std::size_t home () const {
+            return origin;
+        }
+
+        // The program-visible position of index ptr; the starting cell is 0
+        // and cells grown on the left are negative
+        long long position (std::size_t ptr) const {
+            return static_cast<long long>(ptr) - static_cast<long long>(origin);
+        }
+
+        // Move the pointer n cells. The edge rules are applied once for the
+        // whole move, so an in-range move is a single compare.
+        void moveRight (std::size_t &ptr, int n) {
+            if (static_cast<std::size_t>(n) < length - ptr) {
+                ptr += static_cast<std::size_t>(n);
+            } else {
+                edgeRight(ptr, static_cast<std::size_t>(n));
+            }
+        }
+
+        void moveLeft (std::size_t &ptr, int n) {
+            if (static_cast<std::size_t>(n) <= ptr) {
+                ptr -= static_cast<std::size_t>(n);
+            } else {
+                edgeLeft(ptr, static_cast<std::size_t>(n));
+            }
+        }
+
+        // Map ptr + offset onto the tape for the idiom ops, applying the same
+        // edge rules a pointer walk to that cell would
+        std::size_t resolve (std::size_t &ptr, long long offset);
+
+        // Advance by stride until a zero cell is found. The cells already on
+        // the tape are searched with the kernels in scan.h.
+        void scan (std::size_t &ptr, int stride);
+
+        // '!' output: pointer plus `width` cells from it
+        void dump (FILE *out, std::size_t ptr, int width) const;
+
+        // Lay out an all-zero tape of `count` cells with the home cell at
+        // index `home`, as a run that grew that way would have left it, for
+        // --resume. False when the layout does not fit these tape options.
+        bool restore (std::size_t count, std::size_t home);
+
+        // Back to the freshly constructed state: original size, all zero.
+        // Memory committed by growth is returned to the system.
+        void reset ();
+
+    private:
+        // Slow paths for moves that reach past an edge
+        void edgeRight (std::size_t &ptr, std::size_t n);
+
+        void edgeLeft (std::size_t &ptr, std::size_t n);
+
+        // One scan step past the last cell on the tape
+        void stepOff (std::size_t &ptr, int stride);
+
+        void growRight ();
+
+        void growLeft (std::size_t &ptr);
+
+        // Make region[from, to) readable and writable
+        void commit (std::size_t from, std::size_t to);
+
+        [[noreturn]] void limitExceeded () const;
+
+        // First zero at ptr, ptr + stride, ... within the tape, or NO_ZERO
+        std::size_t findZero (std::size_t ptr, int stride) const;
+
+        std::uint8_t *cells    = nullptr; // first cell on the tape
+        std::size_t   cellSize = 1;       // bytes per cell
+        std::size_t   length   = 0;
+        std::size_t   origin   = 0;       // index of the starting cell
+        std::size_t   maxCells = 0;
+        bool          elastic;
+        bool          strict;
+        std::size_t   initialLength;
+        bool          unused = true;
+
+        // Reserved address space when virtual memory is available; cells
+        // points into it at `start`. Otherwise the tape lives in `fallback`
+        // and grows by copying. Offsets into either are in bytes.
+        std::uint8_t             *region       = nullptr;
+        std::size_t               regionSize   = 0;
+        std::size_t               start        = 0;
+        std::size_t               initialStart = 0;
+        std::size_t               committedLo  = 0;
+        std::size_t               committedHi  = 0;
+        std::vector<std::uint8_t> fallback;
+};
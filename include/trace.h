@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "program.h"
+
+// --trace output: one fixed-size record per executed instruction, written
+// into a ring in a memory-mapped file so tracing costs a few stores per
+// step instead of a formatted write. Only the newest `capacity` records
+// survive. `FFS trace-dump` decodes them.
+//
+//   magic "FFST", u32 version, u64 capacity, u64 records written,
+//   u64 reserved, then capacity x TraceRecord (native byte order)
+struct TraceRecord {
+    std::int64_t  ptr;  // pointer position, the starting cell being 0
+    std::uint32_t pc;
+    std::int32_t  arg;
+    std::uint32_t cell; // value under the pointer before the instruction ran
+    std::uint8_t  op;
+    std::uint8_t  reserved[3];
+};
+
+static_assert(sizeof(TraceRecord) == 24, "trace files rely on 24-byte records");
+
+class TraceRing {
+    public:
+        // Throws ffs::Error when the file cannot be created. capacity is
+        // rounded up to a power of two.
+        TraceRing (const std::string &path, std::size_t capacity);
+
+        ~TraceRing ();
+
+        TraceRing (const TraceRing &) = delete;
+
+        TraceRing &operator= (const TraceRing &) = delete;
+
+        void record (std::size_t pc, const Instr &ins, std::int64_t ptr, std::uint32_t cell) {
+            TraceRecord &r = slots[*written & mask];
+            r.ptr          = ptr;
+            r.pc           = static_cast<std::uint32_t>(pc);
+            r.arg          = ins.arg;
+            r.op           = static_cast<std::uint8_t>(ins.op);
+            r.cell         = cell;
+            ++*written;
+        }
+
+    private:
+        std::string              path;
+        TraceRecord *            slots   = nullptr;
+        std::uint64_t            mask    = 0;
+        std::uint64_t *          written = nullptr; // in the file header, so a killed run can still be dumped
+        std::uint64_t            count   = 0;       // stands in for it without mmap
+        void *                   map     = nullptr; // whole-file mapping, if any
+        std::size_t              mapLen  = 0;
+        std::vector<TraceRecord> fallback;          // without mmap: written out on close
+};
+
+// `FFS trace-dump FILE [filters]`: print a trace file as text, oldest record
+// first. Returns the process exit status.
+int trace_dump (int argc, char **argv);
@@ -1,13 +1,53 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "iobuf.h"
 #include "program.h"
 
-int run (const Program &p,
-         int            initCells,
-         bool           elastic,
-         bool           strict,
-         int            dbgWidth,
-         bool           trace,
-         FILE *         fin,
-         FILE *         file_out,
-         FILE *         file_err);
+// Instruction dispatch strategy. THREADED uses computed-goto direct
+// threading where the compiler supports it and the switch loop otherwise.
+// JIT compiles to native code on x86-64 hosts and falls back to THREADED
+// elsewhere, for cells wider than 8 bits, and whenever --trace or --profile
+// is on.
+enum class Engine {
+    SWITCH,
+    THREADED,
+    JIT
+};
+
+struct RunOptions {
+    std::size_t   cells      = 30000;
+    std::size_t   maxCells   = 16 * 1024 * 1024; // how far --elastic may grow
+    bool          elastic    = false;
+    bool          strict     = false;
+    int           dbgWidth   = 8;
+    int           cellBits   = 8; // 8, 16 or 32; programs must be compiled for the same width
+    bool          trace      = false; // record every step, see trace.h
+    std::string   traceOut   = "ffs.trace";
+    std::size_t   traceSize  = 1 << 20; // records kept, rounded up to a power of two
+    bool          profile    = false; // count executions per pc, see profile.h
+    std::string   profileOut = "ffs-profile.folded";
+    std::uint64_t maxSteps   = 0; // instructions, 0 = unlimited
+    double        timeout    = 0; // wall-clock seconds, 0 = unlimited
+    Engine        engine     = Engine::THREADED;
+    FlushMode     flush      = FlushMode::AUTO;
+    std::uint64_t checkpointSteps   = 0; // snapshot every N instructions, 0 = never
+    double        checkpointSeconds = 0; // snapshot every N seconds, 0 = never
+    std::string   checkpointOut     = "ffs.ckpt"; // see checkpoint.h
+    std::string   resumeFrom;                      // snapshot to continue from, if any
+};
+
+class Tape;
+
+// Run p from the tape's home cell with the engine opts asks for, starting
+// from its compile-time prefix where that is safe (see Prefix), or from the
+// snapshot in opts.resumeFrom. Runtime
+// errors are thrown as ffs::Error; reporting them and flushing `out` is up
+// to the caller (see ffs::Vm). When `steps` is given it receives the number
+// of instructions executed, which is only counted under a step or time limit.
+int execute (const Program &p, const RunOptions &opts, Tape &tape, InputSource &in, OutputBuffer &out, FILE *file_err,
+             std::uint64_t *steps = nullptr);
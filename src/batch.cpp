@@ -0,0 +1,283 @@
+#include "batch.h"
+
+#include "bytecode.h"
+#include "error.h"
+#include "ffs.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    struct Job
+    {
+        std::size_t line;
+        std::string program;
+        std::string input;
+        std::string output;
+    };
+
+    // A compiled program shared by every job that names it, or the error
+    // that stopped it compiling
+    struct Compiled
+    {
+        std::shared_ptr<const Program> program;
+        std::optional<ffs::ErrorInfo> error;
+    };
+
+    // Each worker pops from the back of its own deque and, once that runs
+    // dry, steals from the front of the others'. Jobs never spawn jobs, so
+    // a worker that finds every deque empty is done.
+    class WorkQueue
+    {
+    public:
+        WorkQueue(std::size_t jobs, unsigned workers) : lanes(workers)
+        {
+            for (std::size_t i = 0; i < jobs; ++i)
+            {
+                lanes[i % workers].items.push_back(i);
+            }
+        }
+
+        std::optional<std::size_t> next(unsigned self)
+        {
+            if (auto job = lanes[self].take(true))
+            {
+                return job;
+            }
+            for (unsigned k = 1; k < lanes.size(); ++k)
+            {
+                if (auto job = lanes[(self + k) % lanes.size()].take(false))
+                {
+                    return job;
+                }
+            }
+            return std::nullopt;
+        }
+
+    private:
+        struct Lane
+        {
+            std::mutex lock;
+            std::deque<std::size_t> items;
+
+            std::optional<std::size_t> take(bool back)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (items.empty())
+                {
+                    return std::nullopt;
+                }
+                std::size_t job = back ? items.back() : items.front();
+                if (back)
+                {
+                    items.pop_back();
+                }
+                else
+                {
+                    items.pop_front();
+                }
+                return job;
+            }
+        };
+
+        std::vector<Lane> lanes;
+    };
+
+    ffs::ErrorInfo io_failure(const std::string &message, const std::string &path)
+    {
+        ffs::ErrorInfo error(ffs::ErrorCategory::IO, ffs::ErrorCode::FILE_NOT_FOUND, message);
+        error.context = "File: " + path;
+        return error;
+    }
+
+    std::vector<Job> read_manifest(const std::string &path)
+    {
+        std::ifstream in(path);
+        if (!in)
+        {
+            ffs::ErrorReporter::ioError(ffs::ErrorCode::FILE_NOT_FOUND,
+                                        "Could not open batch manifest: " + path,
+                                        path,
+                                        "Check that the file exists and you have permission to read it");
+        }
+        std::vector<Job> jobs;
+        std::string text;
+        for (std::size_t line = 1; std::getline(in, text); ++line)
+        {
+            text = text.substr(0, text.find('#'));
+            std::istringstream fields(text);
+            Job job{line, "", "", ""};
+            std::string extra;
+            if (!(fields >> job.program))
+            {
+                continue;
+            }
+            if (!(fields >> job.input >> job.output) || (fields >> extra))
+            {
+                ffs::ErrorReporter::ioError(ffs::ErrorCode::FILE_READ_ERROR,
+                                            "Malformed batch manifest line " + std::to_string(line),
+                                            path,
+                                            "Each line needs exactly three fields: program input output");
+            }
+            jobs.push_back(job);
+        }
+        return jobs;
+    }
+
+    Compiled compile_job(const std::string &path, int dbgWidth, int cellBits, const std::string &cacheDir)
+    {
+        Compiled result;
+        try
+        {
+            if (is_bytecode_file(path))
+            {
+                if (auto prog = load_bytecode(path))
+                {
+                    result.program = std::make_shared<const Program>(std::move(*prog));
+                    return result;
+                }
+                result.error = io_failure("Bytecode file is damaged or was built by a different FFS version", path);
+                return result;
+            }
+            std::ifstream in(path, std::ios::binary);
+            if (!in)
+            {
+                result.error = io_failure("Could not open file: " + path, path);
+                return result;
+            }
+            result.program = std::make_shared<const Program>(compile_cached(in, path, dbgWidth, cellBits, cacheDir));
+        }
+        catch (const ffs::Error &e)
+        {
+            result.error = e.info();
+        }
+        return result;
+    }
+
+    // One job on a worker's own Vm. The tape is reset rather than rebuilt.
+    std::optional<ffs::ErrorInfo> run_job(ffs::Vm &vm, const Job &job, const Program &program)
+    {
+        FILE *in = job.input == "-" ? nullptr : std::fopen(job.input.c_str(), "rb");
+        if (job.input != "-" && in == nullptr)
+        {
+            return io_failure("Could not open input file: " + job.input, job.input);
+        }
+        FILE *out = job.output == "-" ? nullptr : std::fopen(job.output.c_str(), "wb");
+        if (job.output != "-" && out == nullptr)
+        {
+            if (in != nullptr)
+            {
+                std::fclose(in);
+            }
+            return io_failure("Could not create output file: " + job.output, job.output);
+        }
+
+        if (in != nullptr)
+        {
+            vm.setInput(in);
+        }
+        else
+        {
+            vm.setInput(InputFeed([](std::uint8_t *, std::size_t) { return std::size_t(0); }));
+        }
+        if (out != nullptr)
+        {
+            vm.setOutput(out);
+        }
+        else
+        {
+            vm.setOutput(OutputSink([](const std::uint8_t *, std::size_t) {}));
+        }
+
+        vm.reset();
+        ffs::Result result = vm.run(program);
+
+        // Detach the streams before closing them
+        vm.setInput(InputFeed([](std::uint8_t *, std::size_t) { return std::size_t(0); }));
+        vm.setOutput(OutputSink([](const std::uint8_t *, std::size_t) {}));
+        if (in != nullptr)
+        {
+            std::fclose(in);
+        }
+        if (out != nullptr && std::fclose(out) != 0 && result.ok())
+        {
+            ffs::ErrorInfo error(ffs::ErrorCategory::IO, ffs::ErrorCode::FILE_WRITE_ERROR,
+                                 "Could not write output file: " + job.output);
+            error.context = "File: " + job.output;
+            return error;
+        }
+        return result.error;
+    }
+}
+
+int run_batch(const std::string &manifest, const RunOptions &opts, unsigned threads, const std::string &cacheDir)
+{
+    std::vector<Job> jobs = read_manifest(manifest);
+
+    std::map<std::string, Compiled> programs;
+    for (const auto &job : jobs)
+    {
+        if (programs.find(job.program) == programs.end())
+        {
+            programs.emplace(job.program, compile_job(job.program, opts.dbgWidth, opts.cellBits, cacheDir));
+        }
+    }
+
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned>(std::min<std::size_t>(threads, std::max<std::size_t>(jobs.size(), 1)));
+
+    std::vector<std::optional<ffs::ErrorInfo>> failures(jobs.size());
+    WorkQueue queue(jobs.size(), threads);
+    auto worker = [&](unsigned self) {
+        ffs::Vm vm(opts);
+        while (auto index = queue.next(self))
+        {
+            const Job &job = jobs[*index];
+            const Compiled &compiled = programs.at(job.program);
+            failures[*index] = compiled.error ? compiled.error : run_job(vm, job, *compiled.program);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t)
+    {
+        pool.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto &thread : pool)
+    {
+        thread.join();
+    }
+
+    // Reported in manifest order once everything has finished, so the
+    // summary does not depend on scheduling
+    std::size_t failed = 0;
+    for (std::size_t i = 0; i < jobs.size(); ++i)
+    {
+        if (failures[i])
+        {
+            ++failed;
+            std::cerr << manifest << ":" << jobs[i].line << ": job " << jobs[i].program << " failed" << std::endl;
+            ffs::ErrorReporter::printError(*failures[i]);
+        }
+    }
+    if (failed > 0)
+    {
+        std::cerr << failed << " of " << jobs.size() << " jobs failed" << std::endl;
+    }
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,73 @@
+#include "budget.h"
+
+#include "error.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+Budget::Budget(std::uint64_t maxSteps, double timeoutSeconds, std::uint64_t snapshotSteps, double snapshotSeconds)
+    : maxSteps(maxSteps), timeoutSeconds(timeoutSeconds), snapshotSteps(snapshotSteps), snapshotSeconds(snapshotSeconds),
+      timed(timeoutSeconds > 0 || snapshotSeconds > 0), nextSnapshot(snapshotSteps)
+{
+    if (timed)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        deadline = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                             std::chrono::duration<double>(timeoutSeconds));
+        snapshotAt = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                               std::chrono::duration<double>(snapshotSeconds));
+    }
+    schedule(0);
+}
+
+void Budget::schedule(std::uint64_t steps)
+{
+    nextCheck = maxSteps != 0 ? maxSteps : UINT64_MAX;
+    if (snapshotSteps != 0)
+    {
+        nextCheck = std::min(nextCheck, nextSnapshot);
+    }
+    if (timed)
+    {
+        nextCheck = std::min(nextCheck, steps + POLL_INTERVAL);
+    }
+}
+
+bool Budget::check(std::uint64_t steps)
+{
+    if (maxSteps != 0 && steps > maxSteps)
+    {
+        ffs::ErrorReporter::runtimeError(ffs::ErrorCode::STEP_LIMIT_EXCEEDED,
+                                         "Step limit of " + std::to_string(maxSteps) + " instructions exceeded",
+                                         "Executed " + std::to_string(steps) + " instructions",
+                                         "Raise --max-steps (0 = unlimited) or check your loop conditions");
+    }
+    bool snapshot = false;
+    if (snapshotSteps != 0 && steps >= nextSnapshot)
+    {
+        snapshot = true;
+        nextSnapshot = steps + snapshotSteps;
+    }
+    if (timed)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        if (timeoutSeconds > 0 && now >= deadline)
+        {
+            char limit[32];
+            std::snprintf(limit, sizeof(limit), "%g", timeoutSeconds);
+            ffs::ErrorReporter::runtimeError(ffs::ErrorCode::TIMEOUT,
+                                             "Time limit of " + std::string(limit) + "s exceeded",
+                                             "Executed " + std::to_string(steps) + " instructions",
+                                             "Raise --timeout (0 = unlimited) or check your loop conditions");
+        }
+        if (snapshotSeconds > 0 && now >= snapshotAt)
+        {
+            snapshot = true;
+            snapshotAt = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                   std::chrono::duration<double>(snapshotSeconds));
+        }
+    }
+    schedule(steps);
+    return snapshot;
+}
@@ -0,0 +1,451 @@
+#include "bytecode.h"
+
+#include "compiler.h"
+#include "version.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <istream>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#define FFS_BYTECODE_MMAP 0
+#else
+#define FFS_BYTECODE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    constexpr std::uint8_t MAGIC[4] = {'F', 'F', 'S', 'C'};
+    constexpr std::uint32_t FORMAT = 4;
+    constexpr std::size_t HEADER_SIZE = 4 + 4 + 8 + 8 + 4 + 4 + 4 + 4;
+    constexpr std::size_t INSTR_SIZE = 12;
+
+    static_assert(sizeof(Instr) == INSTR_SIZE && offsetof(Instr, arg) == 4 && offsetof(Instr, offset) == 8,
+                  "the .ffsc instruction layout mirrors Instr");
+
+    std::uint64_t fnv1a(std::uint64_t h, const void *data, std::size_t len)
+    {
+        const auto *p = static_cast<const std::uint8_t *>(data);
+        for (std::size_t i = 0; i < len; ++i)
+        {
+            h = (h ^ p[i]) * 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    constexpr std::uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+
+    bool little_endian()
+    {
+        const std::uint16_t probe = 1;
+        return *reinterpret_cast<const std::uint8_t *>(&probe) == 1;
+    }
+
+    void put32(std::vector<std::uint8_t> &out, std::uint32_t v)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            out.push_back(static_cast<std::uint8_t>(v >> (8 * i)));
+        }
+    }
+
+    void put64(std::vector<std::uint8_t> &out, std::uint64_t v)
+    {
+        put32(out, static_cast<std::uint32_t>(v));
+        put32(out, static_cast<std::uint32_t>(v >> 32));
+    }
+
+    std::uint32_t get32(const std::uint8_t *p)
+    {
+        return static_cast<std::uint32_t>(p[0]) | static_cast<std::uint32_t>(p[1]) << 8 |
+               static_cast<std::uint32_t>(p[2]) << 16 | static_cast<std::uint32_t>(p[3]) << 24;
+    }
+
+    std::uint64_t get64(const std::uint8_t *p)
+    {
+        return get32(p) | static_cast<std::uint64_t>(get32(p + 4)) << 32;
+    }
+
+    // A whole file, read-only: mapped where the platform allows it
+    class FileView
+    {
+    public:
+        explicit FileView(const std::string &path)
+        {
+#if FFS_BYTECODE_MMAP
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                return;
+            }
+            struct stat st{};
+            if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+            {
+                void *mem = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mem != MAP_FAILED)
+                {
+                    map = mem;
+                    bytes = static_cast<const std::uint8_t *>(mem);
+                    len = static_cast<std::size_t>(st.st_size);
+                }
+            }
+            close(fd);
+#else
+            std::ifstream in(path, std::ios::binary);
+            if (in)
+            {
+                buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+                bytes = reinterpret_cast<const std::uint8_t *>(buffer.data());
+                len = buffer.size();
+            }
+#endif
+        }
+
+        ~FileView()
+        {
+#if FFS_BYTECODE_MMAP
+            if (map != nullptr)
+            {
+                munmap(map, len);
+            }
+#endif
+        }
+
+        FileView(const FileView &) = delete;
+        FileView &operator=(const FileView &) = delete;
+
+        const std::uint8_t *data() const
+        {
+            return bytes;
+        }
+
+        std::size_t size() const
+        {
+            return len;
+        }
+
+    private:
+        const std::uint8_t *bytes = nullptr;
+        std::size_t len = 0;
+#if FFS_BYTECODE_MMAP
+        void *map = nullptr;
+#else
+        std::vector<char> buffer;
+#endif
+    };
+
+    bool valid(const Instr &ins, std::size_t size)
+    {
+        if (static_cast<std::size_t>(ins.op) >= OP_COUNT)
+        {
+            return false;
+        }
+        switch (ins.op)
+        {
+        case Op::INC_PTR:
+        case Op::DEC_PTR:
+        case Op::OUT:
+        case Op::IN:
+            return ins.arg >= 1;
+        case Op::JZ:
+        case Op::JNZ:
+        case Op::GUARD:
+            return ins.arg >= 0 && static_cast<std::size_t>(ins.arg) < size;
+        default:
+            return true;
+        }
+    }
+
+    std::string cache_path(const std::string &cacheDir, std::uint64_t key)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.ffsc", static_cast<unsigned long long>(key));
+        return (std::filesystem::path(cacheDir) / name).string();
+    }
+
+    void store(const Program &p, std::uint64_t key, const std::string &cacheDir)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(cacheDir, ec);
+        save_bytecode(p, key, cache_path(cacheDir, key));
+    }
+}
+
+std::uint64_t compiler_key()
+{
+    std::uint64_t h = fnv1a(FNV_OFFSET, ffs_version::VERSION_STRING,
+                            std::char_traits<char>::length(ffs_version::VERSION_STRING));
+    h = fnv1a(h, &FORMAT, sizeof(FORMAT));
+    return fnv1a(h, &COMPILER_REVISION, sizeof(COMPILER_REVISION));
+}
+
+std::uint64_t source_key(const std::string &src, int dbgWidth, int cellBits)
+{
+    std::uint64_t h = fnv1a(FNV_OFFSET, src.data(), src.size());
+    h = fnv1a(h, &dbgWidth, sizeof(dbgWidth));
+    return fnv1a(h, &cellBits, sizeof(cellBits));
+}
+
+bool is_bytecode_file(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    char head[4] = {};
+    return in.read(head, sizeof(head)) && std::equal(std::begin(head), std::end(head), std::begin(MAGIC),
+                                                     [](char a, std::uint8_t b) { return static_cast<std::uint8_t>(a) == b; });
+}
+
+bool save_bytecode(const Program &p, std::uint64_t sourceKey, const std::string &path)
+{
+    std::vector<std::uint8_t> out(std::begin(MAGIC), std::end(MAGIC));
+    put32(out, FORMAT);
+    put64(out, compiler_key());
+    put64(out, sourceKey);
+    put32(out, static_cast<std::uint32_t>(p.code.size()));
+    put32(out, static_cast<std::uint32_t>(p.debug.labels.size()));
+    put32(out, static_cast<std::uint32_t>(p.debug.positions.size()));
+    put32(out, static_cast<std::uint32_t>(p.cellBits));
+    for (const auto &ins : p.code)
+    {
+        put32(out, static_cast<std::uint8_t>(ins.op)); // op byte plus zeroed padding
+        put32(out, static_cast<std::uint32_t>(ins.arg));
+        put32(out, static_cast<std::uint32_t>(ins.offset));
+    }
+    for (const auto &[pc, name] : p.debug.labels)
+    {
+        put32(out, static_cast<std::uint32_t>(pc));
+        put32(out, static_cast<std::uint32_t>(name.size()));
+        out.insert(out.end(), name.begin(), name.end());
+    }
+    for (const auto &[pc, pos] : p.debug.positions)
+    {
+        put32(out, static_cast<std::uint32_t>(pc));
+        put32(out, pos.line);
+        put32(out, pos.column);
+    }
+    put32(out, p.prefix.entry);
+    put32(out, p.prefix.ptr);
+    put32(out, p.prefix.span);
+    put32(out, static_cast<std::uint32_t>(p.prefix.cells.size()));
+    for (std::uint32_t cell : p.prefix.cells)
+    {
+        put32(out, cell);
+    }
+    put32(out, static_cast<std::uint32_t>(p.prefix.output.size()));
+    out.insert(out.end(), p.prefix.output.begin(), p.prefix.output.end());
+
+    // Write next to the target and rename over it, so concurrent readers of
+    // a cache never see a half-written file
+    std::error_code ec;
+    std::string tmp = path + ".tmp" +
+                      std::to_string(std::chrono::steady_clock::now().time_since_epoch().count() ^
+                                     reinterpret_cast<std::uintptr_t>(&out));
+    {
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        if (!file.write(reinterpret_cast<const char *>(out.data()), static_cast<std::streamsize>(out.size())) ||
+            !file.flush())
+        {
+            file.close();
+            std::filesystem::remove(tmp, ec);
+            return false;
+        }
+    }
+    std::filesystem::rename(tmp, path, ec);
+    if (ec)
+    {
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+std::optional<Program> load_bytecode(const std::string &path, std::optional<std::uint64_t> sourceKey)
+{
+    FileView file(path);
+    const std::uint8_t *at = file.data();
+    std::size_t left = file.size();
+    if (left < HEADER_SIZE || !std::equal(std::begin(MAGIC), std::end(MAGIC), at) || get32(at + 4) != FORMAT ||
+        get64(at + 8) != compiler_key() || (sourceKey && get64(at + 16) != *sourceKey))
+    {
+        return std::nullopt;
+    }
+    std::size_t count = get32(at + 24);
+    std::size_t labels = get32(at + 28);
+    std::size_t positions = get32(at + 32);
+    std::uint32_t cellBits = get32(at + 36);
+    if (cellBits != 8 && cellBits != 16 && cellBits != 32)
+    {
+        return std::nullopt;
+    }
+    at += HEADER_SIZE;
+    left -= HEADER_SIZE;
+    if (count > left / INSTR_SIZE)
+    {
+        return std::nullopt;
+    }
+
+    Program p;
+    p.cellBits = static_cast<int>(cellBits);
+    p.code.resize(count);
+    if (little_endian())
+    {
+        std::copy(at, at + count * INSTR_SIZE, reinterpret_cast<std::uint8_t *>(p.code.data()));
+    }
+    else
+    {
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            const std::uint8_t *rec = at + i * INSTR_SIZE;
+            p.code[i] = Instr{static_cast<Op>(rec[0]), static_cast<std::int32_t>(get32(rec + 4)),
+                              static_cast<std::int32_t>(get32(rec + 8))};
+        }
+    }
+    at += count * INSTR_SIZE;
+    left -= count * INSTR_SIZE;
+
+    // Engines trust their input, so a damaged file must not get past here
+    for (const auto &ins : p.code)
+    {
+        if (!valid(ins, count))
+        {
+            return std::nullopt;
+        }
+    }
+
+    for (std::size_t i = 0; i < labels; ++i)
+    {
+        if (left < 8)
+        {
+            return std::nullopt;
+        }
+        auto pc = static_cast<std::int32_t>(get32(at));
+        std::size_t len = get32(at + 4);
+        at += 8;
+        left -= 8;
+        if (len > left)
+        {
+            return std::nullopt;
+        }
+        p.debug.labels.emplace(pc, std::string(reinterpret_cast<const char *>(at), len));
+        at += len;
+        left -= len;
+    }
+
+    if (positions > left / 12)
+    {
+        return std::nullopt;
+    }
+    for (std::size_t i = 0; i < positions; ++i, at += 12)
+    {
+        p.debug.positions.emplace(static_cast<std::int32_t>(get32(at)), SourcePos{get32(at + 4), get32(at + 8)});
+    }
+    left -= positions * 12;
+
+    if (left < 16)
+    {
+        return std::nullopt;
+    }
+    Prefix &pre = p.prefix;
+    pre.entry = get32(at);
+    pre.ptr = get32(at + 4);
+    pre.span = get32(at + 8);
+    std::size_t cells = get32(at + 12);
+    at += 16;
+    left -= 16;
+    if (pre.entry > count || (pre.entry != 0 && pre.ptr >= pre.span) || cells > pre.span || cells > left / 4)
+    {
+        return std::nullopt;
+    }
+    pre.cells.resize(cells);
+    for (std::size_t i = 0; i < cells; ++i, at += 4)
+    {
+        pre.cells[i] = get32(at);
+    }
+    left -= cells * 4;
+    if (left < 4 || get32(at) > left - 4)
+    {
+        return std::nullopt;
+    }
+    pre.output.assign(reinterpret_cast<const char *>(at + 4), get32(at));
+    return p;
+}
+
+Program compile_cached(const std::string &src, const std::string &filename, int dbgWidth, int cellBits,
+                       const std::string &cacheDir)
+{
+    if (cacheDir.empty())
+    {
+        return compile_src(src, dbgWidth, cellBits, filename);
+    }
+    const std::uint64_t key = source_key(src, dbgWidth, cellBits);
+    if (auto prog = load_bytecode(cache_path(cacheDir, key), key))
+    {
+        return std::move(*prog);
+    }
+    Program prog = compile_src(src, dbgWidth, cellBits, filename);
+    store(prog, key, cacheDir);
+    return prog;
+}
+
+Program compile_cached(std::istream &in, const std::string &filename, int dbgWidth, int cellBits,
+                       const std::string &cacheDir, std::uint64_t *sourceKey)
+{
+    // The same key source_key() gives, built up chunk by chunk
+    std::uint64_t h = FNV_OFFSET;
+    auto hash = [&](const char *data, std::size_t size) { h = fnv1a(h, data, size); };
+    auto key = [&]
+    {
+        std::uint64_t k = fnv1a(fnv1a(h, &dbgWidth, sizeof(dbgWidth)), &cellBits, sizeof(cellBits));
+        if (sourceKey != nullptr)
+        {
+            *sourceKey = k;
+        }
+        return k;
+    };
+
+    if (cacheDir.empty())
+    {
+        Program prog = compile_stream(in, dbgWidth, cellBits, filename, hash);
+        key();
+        return prog;
+    }
+
+    // The key is needed before compiling, so a file is read twice: once to
+    // hash it and, on a miss, again to compile it. A pipe can only be read
+    // once and is buffered whole instead.
+    const std::streampos start = in.tellg();
+    if (start == std::streampos(-1))
+    {
+        std::string src(std::istreambuf_iterator<char>(in), {});
+        if (sourceKey != nullptr)
+        {
+            *sourceKey = source_key(src, dbgWidth, cellBits);
+        }
+        return compile_cached(src, filename, dbgWidth, cellBits, cacheDir);
+    }
+    std::vector<char> chunk(64 * 1024);
+    while (in.read(chunk.data(), static_cast<std::streamsize>(chunk.size())) || in.gcount() > 0)
+    {
+        hash(chunk.data(), static_cast<std::size_t>(in.gcount()));
+    }
+    const std::uint64_t k = key();
+    if (auto prog = load_bytecode(cache_path(cacheDir, k), k))
+    {
+        return std::move(*prog);
+    }
+    in.clear();
+    in.seekg(start);
+    Program prog = compile_stream(in, dbgWidth, cellBits, filename);
+    store(prog, k, cacheDir);
+    return prog;
+}
@@ -0,0 +1,546 @@
+#include "cgen.h"
+
+#include "version.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/wait.h>
+#endif
+
+namespace
+{
+    // Everything the generated main() needs besides the program itself. It
+    // mirrors tape.cpp and the engines in vm.cpp, error texts included, so
+    // a native binary fails the same way the interpreter does.
+    constexpr const char *RUNTIME = R"(#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define PUT(c) putc_unlocked((c), stdout)
+#define GET() getc_unlocked(stdin)
+#define IS_TTY(fd) isatty(fd)
+#else
+#define PUT(c) putc((c), stdout)
+#define GET() getc(stdin)
+#define IS_TTY(fd) 0
+#endif
+
+/* Not every program calls every helper. p < len holds throughout main();
+   saying so before each move keeps GCC from reporting out-of-bounds writes
+   on paths it cannot rule out by itself. */
+#if defined(__GNUC__)
+#define HELPER static __attribute__((unused))
+#define ASSUME(c) ((c) ? (void)0 : __builtin_unreachable())
+#else
+#define HELPER static
+#define ASSUME(c) ((void)0)
+#endif
+
+struct tape
+{
+    cell *cells;
+    size_t length;
+    size_t origin; /* index of the starting cell */
+};
+
+HELPER long long position(const struct tape *t, size_t ptr)
+{
+    return (long long)ptr - (long long)t->origin;
+}
+
+/* note is a format for value */
+HELPER void fail(const char *code, const char *message, const char *note, long long value, const char *help)
+{
+    fflush(stdout);
+    fprintf(stderr, "error[runtime:%s]: %s\n  note: ", code, message);
+    fprintf(stderr, note, value);
+    fprintf(stderr, "\n  help: %s\n\n", help);
+    exit(1);
+}
+
+HELPER void commit(struct tape *t, size_t length)
+{
+    cell *cells = (cell *)realloc(t->cells, length * sizeof(cell));
+    if (cells == NULL)
+    {
+        fail("memory-limit", "Out of memory while growing the tape", "Current memory usage: %lld cells", (long long)t->length,
+             "Lower --max-cells or use fewer cells");
+    }
+    t->cells = cells;
+}
+
+HELPER void limit_exceeded(const struct tape *t)
+{
+    fflush(stdout);
+    fprintf(stderr, "error[runtime:memory-limit]: Memory limit of %llu cells exceeded\n"
+                    "  note: Current memory usage: %llu cells\n"
+                    "  help: Raise --max-cells, use fewer cells or optimize your program\n\n",
+            (unsigned long long)MAX_CELLS, (unsigned long long)t->length);
+    exit(1);
+}
+
+HELPER void grow_right(struct tape *t)
+{
+    size_t length;
+    if (t->length >= MAX_CELLS)
+    {
+        limit_exceeded(t);
+    }
+    length = t->length * 2 > t->length + 1 ? t->length * 2 : t->length + 1;
+    length = length < MAX_CELLS ? length : MAX_CELLS;
+    commit(t, length);
+    memset(t->cells + t->length, 0, (length - t->length) * sizeof(cell));
+    t->length = length;
+}
+
+HELPER void grow_left(struct tape *t, size_t *ptr)
+{
+    size_t grow = t->length > 1 ? t->length : 1;
+    if (t->length >= MAX_CELLS)
+    {
+        limit_exceeded(t);
+    }
+    grow = grow < MAX_CELLS - t->length ? grow : MAX_CELLS - t->length;
+    commit(t, t->length + grow);
+    memmove(t->cells + grow, t->cells, t->length * sizeof(cell));
+    memset(t->cells, 0, grow * sizeof(cell));
+    t->length += grow;
+    t->origin += grow;
+    *ptr += grow;
+}
+
+HELPER void edge_right(struct tape *t, size_t *ptr, size_t n)
+{
+    if (ELASTIC)
+    {
+        while (n >= t->length - *ptr)
+        {
+            grow_right(t);
+        }
+        *ptr += n;
+        return;
+    }
+    if (STRICT)
+    {
+        fail("pointer-overflow", "Pointer moved beyond available memory", "Attempted to access position %lld",
+             position(t, t->length - 1), "Use '<' to move the pointer back or ensure adequate memory");
+    }
+    *ptr = t->length - 1;
+}
+
+HELPER void edge_left(struct tape *t, size_t *ptr, size_t n)
+{
+    if (ELASTIC)
+    {
+        while (n > *ptr)
+        {
+            grow_left(t, ptr);
+        }
+        *ptr -= n;
+        return;
+    }
+    if (STRICT)
+    {
+        fail("pointer-underflow", "Pointer moved below zero", "Attempted to access negative position %lld",
+             position(t, 0), "Use '>' to move the pointer forward or check your pointer movements");
+    }
+    *ptr = 0;
+}
+
+HELPER void move(struct tape *t, size_t *ptr, long long n)
+{
+    if (n >= 0)
+    {
+        if ((size_t)n < t->length - *ptr)
+        {
+            *ptr += (size_t)n;
+        }
+        else
+        {
+            edge_right(t, ptr, (size_t)n);
+        }
+    }
+    else if ((size_t)-n <= *ptr)
+    {
+        *ptr -= (size_t)-n;
+    }
+    else
+    {
+        edge_left(t, ptr, (size_t)-n);
+    }
+}
+
+/* ptr + offset for the offset-addressed ops, under the same edge rules */
+HELPER size_t resolve(struct tape *t, size_t *ptr, long long offset)
+{
+    long long target = (long long)*ptr + offset;
+    while (ELASTIC && target < 0)
+    {
+        size_t before = *ptr;
+        grow_left(t, ptr);
+        target += (long long)(*ptr - before);
+    }
+    if (target < 0)
+    {
+        if (STRICT)
+        {
+            fail("pointer-underflow", "Loop moved the pointer below zero", "Attempted to access negative position %lld",
+                 target - (long long)t->origin, "Use '>' to move the pointer forward or check your pointer movements");
+        }
+        return 0;
+    }
+    while (ELASTIC && (size_t)target >= t->length)
+    {
+        grow_right(t);
+    }
+    if ((size_t)target >= t->length)
+    {
+        if (STRICT)
+        {
+            fail("pointer-overflow", "Loop moved the pointer beyond available memory", "Attempted to access position %lld",
+                 target - (long long)t->origin, "Use '<' to move the pointer back or ensure adequate memory");
+        }
+        return t->length - 1;
+    }
+    return (size_t)target;
+}
+
+HELPER void scan(struct tape *t, size_t *ptr, int stride)
+{
+    while (t->cells[*ptr] != 0)
+    {
+        long long before = position(t, *ptr);
+        if (sizeof(cell) == 1 && stride == 1)
+        {
+            const cell *zero = (const cell *)memchr(t->cells + *ptr, 0, t->length - *ptr);
+            if (zero != NULL)
+            {
+                *ptr = (size_t)(zero - t->cells);
+                return;
+            }
+            *ptr = t->length - 1;
+            before = position(t, *ptr);
+        }
+        move(t, ptr, stride);
+        if (position(t, *ptr) == before && t->cells[*ptr] != 0)
+        {
+            fflush(stdout);
+            fprintf(stderr, "error[runtime:internal]: Infinite loop detected\n"
+                            "  note: Scan loop is stuck at the tape edge (position %lld)\n"
+                            "  help: Check your loop conditions and ensure they can terminate\n\n",
+                    position(t, *ptr));
+            exit(1);
+        }
+    }
+}
+
+HELPER void dump(const struct tape *t, size_t ptr)
+{
+    size_t right = ptr + DBG_WIDTH < t->length ? ptr + DBG_WIDTH : t->length;
+    size_t i;
+    fprintf(stderr, "! ptr=%lld cells=[", position(t, ptr));
+    for (i = ptr; i < right; ++i)
+    {
+        fprintf(stderr, i > ptr ? " %u" : "%u", (unsigned)t->cells[i]);
+    }
+    fprintf(stderr, "]\n");
+}
+
+HELPER void put(cell value, int count)
+{
+    while (count-- > 0)
+    {
+        PUT((unsigned char)value);
+    }
+}
+
+/* Consume count bytes and keep the last; EOF stores all ones */
+HELPER cell get(int interactive, int count)
+{
+    int ch = EOF;
+    if (interactive)
+    {
+        fflush(stdout);
+    }
+    while (count-- > 0 && (ch = GET()) != EOF)
+    {
+    }
+    return ch == EOF ? (cell)~(cell)0 : (cell)ch;
+}
+
+#define SYNC() (m = t.cells, len = t.length)
+#define RIGHT(n) (ASSUME(p < len), (size_t)(n) < len - p ? (void)(p += (n)) : (edge_right(&t, &p, (n)), (void)SYNC()))
+#define LEFT(n) (ASSUME(p < len), (size_t)(n) <= p ? (void)(p -= (n)) : (edge_left(&t, &p, (n)), (void)SYNC()))
+#define AT(off) (ASSUME(p < len), (a = p + (size_t)(ptrdiff_t)(off)) < len ? (void)0 : (a = resolve(&t, &p, (off)), (void)SYNC()))
+#define PAST_RIGHT(n) (ASSUME(p < len), (size_t)(n) >= len - p)
+#define PAST_LEFT(n) (ASSUME(p < len), (size_t)(n) > p)
+
+int main(void)
+{
+    struct tape t;
+    cell *m;
+    size_t len;
+    size_t p = 0;
+    size_t a = 0;
+    const int interactive = IS_TTY(0);
+
+    t.length = CELLS;
+    t.origin = 0;
+    t.cells = (cell *)calloc(CELLS, sizeof(cell));
+    if (t.cells == NULL)
+    {
+        fail("memory-limit", "Out of memory while growing the tape", "Current memory usage: %lld cells", 0,
+             "Lower --max-cells or use fewer cells");
+    }
+    m = t.cells;
+    len = t.length;
+    (void)len;
+    (void)a;
+    (void)interactive;
+)";
+
+    std::string literal(std::uint32_t value)
+    {
+        return std::to_string(value) + "u";
+    }
+
+    // A C string literal for arbitrary bytes. Octal escapes are always
+    // three digits so a following digit is never swallowed.
+    std::string quoted(const std::string &bytes)
+    {
+        std::string out = "\"";
+        for (unsigned char c : bytes)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += static_cast<char>(c);
+            }
+            else if (c >= 0x20 && c < 0x7F && c != '?')
+            {
+                out += static_cast<char>(c);
+            }
+            else
+            {
+                const char digits[] = {'\\', static_cast<char>('0' + (c >> 6)), static_cast<char>('0' + ((c >> 3) & 7)),
+                                       static_cast<char>('0' + (c & 7))};
+                out.append(digits, sizeof(digits));
+            }
+            if (c == '\n')
+            {
+                out += "\"\n        \"";
+            }
+        }
+        return out + "\"";
+    }
+
+    // The cell an op addresses: m[p] itself, or m[a] once AT() has
+    // resolved the offset
+    std::string target(const Instr &ins, std::string &code)
+    {
+        if (ins.offset == 0)
+        {
+            return "m[p]";
+        }
+        code += "AT(" + std::to_string(ins.offset) + "); ";
+        return "m[a]";
+    }
+
+    // One argument for the shell std::system hands the command to: sh on
+    // POSIX, cmd.exe on Windows, where paths cannot contain '"'
+    std::string quote_arg(const std::string &arg)
+    {
+#ifdef _WIN32
+        return "\"" + arg + "\"";
+#else
+        std::string out = "'";
+        for (char c : arg)
+        {
+            out += c == '\'' ? std::string("'\\''") : std::string(1, c);
+        }
+        return out + "'";
+#endif
+    }
+} // namespace
+
+std::string emit_c(const Program &p, const RunOptions &opts, const std::string &source)
+{
+    const std::uint32_t mask = p.cellBits >= 32 ? 0xFFFFFFFFu : (1u << p.cellBits) - 1;
+    const std::size_t cells = opts.cells > 0 ? opts.cells : 30000;
+    const std::size_t maxCells = std::max(opts.maxCells, cells);
+
+    std::string c = "/* Generated by FFS " + std::string(ffs_version::VERSION_STRING);
+    if (!source.empty())
+    {
+        // A path may hold "*/" or line breaks, which would end the comment
+        std::string name;
+        for (char ch : source)
+        {
+            if (ch == '\n' || ch == '\r')
+            {
+                ch = ' ';
+            }
+            if (ch == '/' && !name.empty() && name.back() == '*')
+            {
+                name += ' ';
+            }
+            name += ch;
+        }
+        c += " from " + name;
+    }
+    c += " */\n\n";
+    c += "typedef " + std::string(p.cellBits == 32 ? "uint32_t" : p.cellBits == 16 ? "uint16_t" : "uint8_t") +
+         " cell;\n";
+    c += "#define CELLS ((size_t)" + std::to_string(cells) + "u)\n";
+    c += "#define MAX_CELLS ((size_t)" + std::to_string(maxCells) + "u)\n";
+    c += "#define ELASTIC " + std::string(opts.elastic ? "1" : "0") + "\n";
+    c += "#define STRICT " + std::string(opts.strict ? "1" : "0") + "\n";
+    c += "#define DBG_WIDTH ((size_t)" + std::to_string(opts.dbgWidth) + "u)\n\n";
+    // The runtime's #includes come after the typedef, which only needs
+    // <stdint.h>
+    c = "#include <stdint.h>\n" + c + RUNTIME;
+
+    // The compile-time prefix holds for this fresh tape when it fits
+    const Prefix &pre = p.prefix;
+    const bool resume = pre.entry != 0 && pre.span <= cells;
+    if (resume)
+    {
+        for (std::size_t i = 0; i < pre.cells.size(); ++i)
+        {
+            if (pre.cells[i] != 0)
+            {
+                c += "    m[" + std::to_string(i) + "] = " + literal(pre.cells[i]) + ";\n";
+            }
+        }
+        if (!pre.output.empty())
+        {
+            c += "    fwrite(" + quoted(pre.output) + ", 1, " + std::to_string(pre.output.size()) + ", stdout);\n";
+        }
+        c += "    p = " + std::to_string(pre.ptr) + ";\n";
+        c += "    goto resume;\n";
+    }
+    c += "\n";
+
+    // Loops are properly nested after linking, so JZ/JNZ map onto while;
+    // resuming part-way jumps into the block, which C allows
+    std::vector<bool> guarded(p.code.size() + 1, false);
+    for (const Instr &ins : p.code)
+    {
+        if (ins.op == Op::GUARD)
+        {
+            guarded[static_cast<std::size_t>(ins.arg)] = true;
+        }
+    }
+    int depth = 1;
+    for (std::size_t pc = 0; pc <= p.code.size(); ++pc)
+    {
+        if (resume && pc == pre.entry)
+        {
+            c += "resume:;\n";
+        }
+        if (guarded[pc])
+        {
+            c += "guard_" + std::to_string(pc) + ":;\n";
+        }
+        if (pc == p.code.size())
+        {
+            break;
+        }
+        const Instr &ins = p.code[pc];
+        if (ins.op == Op::JNZ)
+        {
+            --depth;
+        }
+        const std::string indent(static_cast<std::size_t>(std::min(depth, 32)) * 4, ' ');
+        std::string line = indent;
+        const std::uint32_t arg = static_cast<std::uint32_t>(ins.arg) & mask;
+        switch (ins.op)
+        {
+        case Op::INC_PTR:
+            line += "RIGHT(" + std::to_string(ins.arg) + ");";
+            break;
+        case Op::DEC_PTR:
+            line += "LEFT(" + std::to_string(ins.arg) + ");";
+            break;
+        case Op::INC:
+        case Op::DEC:
+        {
+            std::string cell = target(ins, line);
+            line += cell + (ins.op == Op::INC ? " += " : " -= ") + literal(arg) + ";";
+            break;
+        }
+        case Op::OUT:
+        {
+            std::string cell = target(ins, line);
+            line += ins.arg == 1 ? "PUT((unsigned char)" + cell + ");" : "put(" + cell + ", " + std::to_string(ins.arg) + ");";
+            break;
+        }
+        case Op::IN:
+        {
+            std::string cell = target(ins, line);
+            line += cell + " = get(interactive, " + std::to_string(ins.arg) + ");";
+            break;
+        }
+        case Op::JZ:
+            line += "while (m[p])\n" + indent + "{";
+            ++depth;
+            break;
+        case Op::JNZ:
+            line += "}";
+            break;
+        case Op::ZERO_IF_EOF:
+        {
+            std::string cell = target(ins, line);
+            line += "if (" + cell + " == (cell)~(cell)0) " + cell + " = 0;";
+            break;
+        }
+        case Op::DBG:
+            line += "dump(&t, p);";
+            break;
+        case Op::CLEAR:
+            line += "m[p] = 0;";
+            break;
+        case Op::SET:
+            line += "m[p] = " + literal(arg) + ";";
+            break;
+        case Op::GUARD:
+            line += ins.offset > 0 ? "if (PAST_RIGHT(" + std::to_string(ins.offset) + "))"
+                                   : "if (PAST_LEFT(" + std::to_string(-static_cast<long long>(ins.offset)) + "))";
+            line += " goto guard_" + std::to_string(ins.arg) + ";";
+            break;
+        case Op::MUL_ADD:
+            line += "if (m[p]) { cell f = m[p]; AT(" + std::to_string(ins.offset) + "); m[a] += (cell)(f * " + literal(arg) +
+                    "); }";
+            break;
+        case Op::SCAN:
+            line += "scan(&t, &p, " + std::to_string(ins.arg) + "); SYNC();";
+            break;
+        }
+        c += line + "\n";
+    }
+    c += "    return 0;\n}\n";
+    return c;
+}
+
+int build_native(const std::string &cPath, const std::string &exePath)
+{
+    const char *cc = std::getenv("CC");
+    std::string command = std::string(cc != nullptr && *cc != '\0' ? cc : "cc") + " -O2 -o " + quote_arg(exePath) +
+                          " " + quote_arg(cPath);
+    int status = std::system(command.c_str());
+#ifdef WEXITSTATUS
+    if (status != -1 && WIFEXITED(status))
+    {
+        return WEXITSTATUS(status);
+    }
+#endif
+    return status == 0 ? 0 : 1;
+}
@@ -0,0 +1,413 @@
+#include "checkpoint.h"
+
+#include "error.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FFS_CHECKPOINT_FORK 1
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#else
+#define FFS_CHECKPOINT_FORK 0
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX // std::min below
+#endif
+#include <windows.h>
+#include <io.h>
+#endif
+
+namespace
+{
+    constexpr char MAGIC[4] = {'F', 'F', 'S', 'K'};
+    constexpr std::uint32_t FORMAT = 2;
+
+    struct Header
+    {
+        char magic[4];
+        std::uint32_t format;
+        std::uint64_t program;
+        std::uint32_t cellBits;
+        std::uint32_t reserved;
+        std::uint64_t pc;
+        std::uint64_t length;
+        std::uint64_t home;
+        std::uint64_t ptr;
+        std::uint64_t input;
+        std::uint64_t output;
+        std::uint64_t origin;
+        std::uint64_t runs;
+    };
+
+    static_assert(sizeof(Header) == 88, "checkpoint header layout changed");
+
+    // The tape is split into blocks of this many bytes and only blocks with
+    // a nonzero byte are stored, adjacent ones merged into one run
+    constexpr std::size_t BLOCK = 64;
+
+    bool zero_block(const std::uint8_t *at, std::size_t len)
+    {
+        std::uint8_t any = 0;
+        for (std::size_t i = 0; i < len; ++i)
+        {
+            any |= at[i];
+        }
+        return any == 0;
+    }
+
+    // Calls fn(firstByte, byteCount) for each run of nonzero blocks
+    template <typename Fn>
+    bool for_each_run(const std::uint8_t *data, std::size_t bytes, Fn fn)
+    {
+        std::size_t i = 0;
+        while (i < bytes)
+        {
+            if (zero_block(data + i, std::min(BLOCK, bytes - i)))
+            {
+                i += BLOCK;
+                continue;
+            }
+            std::size_t first = i;
+            while (i < bytes && !zero_block(data + i, std::min(BLOCK, bytes - i)))
+            {
+                i += BLOCK;
+            }
+            if (!fn(first, std::min(i, bytes) - first))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+#if FFS_CHECKPOINT_FORK
+    using Handle = int;
+#else
+    using Handle = FILE *;
+#endif
+
+    // Buffered writes to a file. Used from the forked child, so on POSIX it
+    // sticks to system calls: no allocation, no stdio, no locks.
+    class Sink
+    {
+    public:
+        explicit Sink(Handle file) : file(file)
+        {
+        }
+
+        bool put(const void *data, std::size_t n)
+        {
+            const auto *p = static_cast<const std::uint8_t *>(data);
+            if (len + n > sizeof(buf))
+            {
+                if (!drain())
+                {
+                    return false;
+                }
+                // Large runs go straight out
+                if (n > sizeof(buf))
+                {
+                    return raw(p, n);
+                }
+            }
+            std::copy_n(p, n, buf + len);
+            len += n;
+            return true;
+        }
+
+        bool drain()
+        {
+            bool ok = raw(buf, len);
+            len = 0;
+            return ok;
+        }
+
+    private:
+        bool raw(const std::uint8_t *p, std::size_t n)
+        {
+            while (n > 0)
+            {
+#if FFS_CHECKPOINT_FORK
+                ssize_t w = ::write(file, p, n);
+                if (w < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+#else
+                std::size_t w = std::fwrite(p, 1, n, file);
+#endif
+                if (w <= 0)
+                {
+                    return false;
+                }
+                p += w;
+                n -= static_cast<std::size_t>(w);
+            }
+            return true;
+        }
+
+        Handle file;
+        std::uint8_t buf[16 * 1024]; // on the stack of whoever writes
+        std::size_t len = 0;
+    };
+
+    bool write_snapshot(Sink &sink, Header header, const Tape &tape)
+    {
+        const std::uint8_t *data = tape.data();
+        const std::size_t cellSize = static_cast<std::size_t>(tape.cellBits() / 8);
+        const std::size_t bytes = tape.size() * cellSize;
+        header.runs = 0;
+        for_each_run(data, bytes, [&](std::size_t, std::size_t)
+                     {
+                         ++header.runs;
+                         return true;
+                     });
+        if (!sink.put(&header, sizeof(header)))
+        {
+            return false;
+        }
+        // BLOCK is a multiple of every cell size, so runs start and end on
+        // cell boundaries
+        return for_each_run(data, bytes, [&](std::size_t first, std::size_t len)
+                            {
+                                const std::uint64_t run[2] = {first / cellSize, len / cellSize};
+                                return sink.put(run, sizeof(run)) && sink.put(data + first, len);
+                            }) &&
+               sink.drain();
+    }
+
+#if FFS_CHECKPOINT_FORK
+    // Write to temp, make it durable and move it over path, so a crash at
+    // any point leaves the previous snapshot intact
+    bool write_file(const char *temp, const char *path, const Header &header, const Tape &tape)
+    {
+        int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            return false;
+        }
+        Sink sink(fd);
+        bool ok = write_snapshot(sink, header, tape) && fsync(fd) == 0;
+        ok = close(fd) == 0 && ok;
+        return ok && rename(temp, path) == 0;
+    }
+#else
+    // Move temp over path in one step where the platform can; elsewhere the
+    // old snapshot is only removed once the new one is complete in temp
+    bool replace_file(const std::string &temp, const std::string &path)
+    {
+#ifdef _WIN32
+        return MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+        return std::rename(temp.c_str(), path.c_str()) == 0 ||
+               (std::remove(path.c_str()) == 0 && std::rename(temp.c_str(), path.c_str()) == 0);
+#endif
+    }
+#endif
+
+    // A lost snapshot is not worth stopping the run for
+    void report_failure(const std::string &path)
+    {
+        ffs::ErrorInfo error(ffs::ErrorCategory::IO, ffs::ErrorCode::FILE_WRITE_ERROR, "Could not write checkpoint: " + path);
+        error.context = "File: " + path;
+        error.suggestion = "The run carries on; check that the directory is writable and has space";
+        std::fflush(stdout);
+        ffs::ErrorReporter::printError(error);
+    }
+
+    [[noreturn]] void cannot_resume(const std::string &path, const std::string &why, const std::string &help)
+    {
+        ffs::ErrorInfo error(ffs::ErrorCategory::IO, ffs::ErrorCode::FILE_READ_ERROR, "Cannot resume from " + path + ": " + why);
+        error.context = "File: " + path;
+        error.suggestion = help;
+        throw ffs::Error(error);
+    }
+} // namespace
+
+std::uint64_t program_key(const Program &p)
+{
+    std::uint64_t h = 0xcbf29ce484222325ULL;
+    auto mix = [&](std::uint32_t v)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            h = (h ^ ((v >> (8 * i)) & 0xFF)) * 0x100000001b3ULL;
+        }
+    };
+    mix(static_cast<std::uint32_t>(p.cellBits));
+    for (const auto &ins : p.code)
+    {
+        mix(static_cast<std::uint32_t>(ins.op));
+        mix(static_cast<std::uint32_t>(ins.arg));
+        mix(static_cast<std::uint32_t>(ins.offset));
+    }
+    return h;
+}
+
+Checkpointer::Checkpointer(const Program &p, const std::string &path)
+    : key(program_key(p)), cellBits(p.cellBits), path(path), temp(path + ".tmp")
+{
+}
+
+Checkpointer::~Checkpointer()
+{
+    settle(true);
+}
+
+bool Checkpointer::settle(bool wait)
+{
+#if FFS_CHECKPOINT_FORK
+    if (child == 0)
+    {
+        return true;
+    }
+    int status = 0;
+    pid_t done;
+    do
+    {
+        done = waitpid(static_cast<pid_t>(child), &status, wait ? 0 : WNOHANG);
+    } while (done < 0 && errno == EINTR);
+    if (done == 0)
+    {
+        return false;
+    }
+    child = 0;
+    if (done < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        report_failure(path);
+    }
+#else
+    (void)wait;
+#endif
+    return true;
+}
+
+void Checkpointer::take(std::size_t pc, std::size_t ptr, const Tape &tape, const InputSource &in, OutputBuffer &out)
+{
+    // The previous snapshot is still being written; this one is skipped
+    // rather than stalling the run
+    if (!settle(false))
+    {
+        return;
+    }
+    out.flush();
+
+    Header header{};
+    std::copy_n(MAGIC, sizeof(MAGIC), header.magic);
+    header.format = FORMAT;
+    header.program = key;
+    header.cellBits = static_cast<std::uint32_t>(cellBits);
+    header.pc = pc;
+    header.length = tape.size();
+    header.home = tape.home();
+    header.ptr = ptr;
+    header.input = in.consumed();
+    header.output = out.written();
+    header.origin = out.origin();
+
+#if FFS_CHECKPOINT_FORK
+    // The child sees the tape as it is now, copy-on-write, while the run
+    // carries on in the parent. It leaves with _exit, so stdio buffers it
+    // inherited are never written twice.
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        _exit(write_file(temp.c_str(), path.c_str(), header, tape) ? 0 : 1);
+    }
+    if (pid > 0)
+    {
+        child = pid;
+        return;
+    }
+    // No fork (out of processes): write it in place
+    if (write_file(temp.c_str(), path.c_str(), header, tape))
+    {
+        return;
+    }
+#else
+    FILE *file = std::fopen(temp.c_str(), "wb");
+    if (file != nullptr)
+    {
+        Sink sink(file);
+        bool ok = write_snapshot(sink, header, tape) && std::fflush(file) == 0;
+#ifdef _WIN32
+        ok = ok && _commit(_fileno(file)) == 0;
+#endif
+        ok = std::fclose(file) == 0 && ok;
+        if (ok && replace_file(temp, path))
+        {
+            return;
+        }
+    }
+#endif
+    report_failure(path);
+}
+
+Resume load_checkpoint(const std::string &path, const Program &p, Tape &tape)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+    {
+        cannot_resume(path, "the file could not be opened", "Check the path given to --resume");
+    }
+    std::vector<std::uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    Header header{};
+    if (bytes.size() < sizeof(header) || !std::equal(MAGIC, MAGIC + sizeof(MAGIC), bytes.begin()))
+    {
+        cannot_resume(path, "not a checkpoint file", "Pass a file written by --checkpoint-every");
+    }
+    std::copy_n(bytes.data(), sizeof(header), reinterpret_cast<std::uint8_t *>(&header));
+    if (header.format != FORMAT)
+    {
+        cannot_resume(path, "written by a different FFS version", "Start the run again with this version");
+    }
+    if (header.program != program_key(p) || header.cellBits != static_cast<std::uint32_t>(p.cellBits))
+    {
+        cannot_resume(path, "it was taken for a different program",
+                      "Resume with the same program and --cell-bits the checkpoint was taken with");
+    }
+    if (header.pc >= p.code.size() || header.home >= header.length || header.ptr >= header.length ||
+        !tape.restore(static_cast<std::size_t>(header.length), static_cast<std::size_t>(header.home)))
+    {
+        cannot_resume(path, "the tape does not fit the current options",
+                      "Resume with the --cells, --max-cells and --elastic the checkpoint was taken with");
+    }
+
+    const std::size_t cellSize = static_cast<std::size_t>(p.cellBits / 8);
+    std::size_t at = sizeof(header);
+    for (std::uint64_t r = 0; r < header.runs; ++r)
+    {
+        std::uint64_t run[2];
+        if (bytes.size() - at < sizeof(run))
+        {
+            cannot_resume(path, "the file is truncated", "Resume from an older checkpoint or start again");
+        }
+        std::copy_n(bytes.data() + at, sizeof(run), reinterpret_cast<std::uint8_t *>(run));
+        at += sizeof(run);
+        if (run[0] > header.length || run[1] > header.length - run[0] || (bytes.size() - at) / cellSize < run[1])
+        {
+            cannot_resume(path, "the file is truncated", "Resume from an older checkpoint or start again");
+        }
+        std::copy_n(bytes.data() + at, run[1] * cellSize, tape.data() + run[0] * cellSize);
+        at += run[1] * cellSize;
+    }
+
+    Resume resume;
+    resume.pc = static_cast<std::size_t>(header.pc);
+    resume.ptr = static_cast<std::size_t>(header.ptr);
+    resume.input = header.input;
+    resume.output = header.output;
+    resume.origin = header.origin;
+    return resume;
+}
@@ -1,197 +1,716 @@
 #include "compiler.h"
 #include "error.h"
+#include "prefix.h"
 
+#include <algorithm>
 #include <cctype>
+#include <climits>
+#include <cstdint>
+#include <istream>
+#include <map>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 namespace
 {
-    // Helper to calculate line and column from position
-    ffs::SourceLocation calculateLocation(const std::string &source, size_t position,
-                                          const std::string &filename = "")
+    // Forward-only cursor over the source that steps over comments as it
+    // goes, so the tokens around a comment join up exactly as if it had been
+    // cut out first ('+x1/* */2' repeats 12 times). Keeps the line and column
+    // of the next character current, so locations cost nothing to look up.
+    // Reading from a stream, only a fixed window of the source is held.
+    class Lexer
     {
-        size_t line = 1;
-        size_t column = 1;
+    public:
+        Lexer(std::string_view src, const std::string &filename) : src(src), filename(filename)
+        {
+            skipComments();
+        }
+
+        // `tap` sees every chunk of the source as it is read
+        Lexer(std::istream &in, const std::string &filename, const SourceTap &tap)
+            : in(&in), tap(&tap), window(WINDOW), filename(filename)
+        {
+            refill();
+            skipComments();
+        }
+
+        bool done() const
+        {
+            return at >= src.size();
+        }
+
+        // The next character; only valid while !done()
+        char peek() const
+        {
+            return src[at];
+        }
+
+        void advance()
+        {
+            step();
+            skipComments();
+        }
+
+        SourcePos position() const
+        {
+            return {line, column};
+        }
+
+        ffs::SourceLocation location() const
+        {
+            return ffs::SourceLocation(line, column, base + at, filename);
+        }
 
-        for (size_t i = 0; i < position && i < source.size(); ++i)
+    private:
+        static constexpr std::size_t WINDOW = 64 * 1024;
+
+        void step()
         {
-            if (source[i] == '\n')
+            if (src[at] == '\n')
             {
-                line++;
+                ++line;
                 column = 1;
             }
             else
             {
-                column++;
+                ++column;
+            }
+            // Comment delimiters need one character of lookahead, so the
+            // window is topped up before it runs down to its last one
+            if (++at + 1 >= src.size() && in != nullptr)
+            {
+                refill();
             }
         }
 
-        return ffs::SourceLocation(line, column, position, filename);
-    }
-
-    // Strip comments and normalize source prior to tokenization
-    std::string strip_comments(const std::string &s)
-    {
-        std::string out;
-        out.reserve(s.size());
-        bool inBlock = false;
+        void refill()
+        {
+            std::size_t keep = src.size() - at;
+            std::copy(src.begin() + static_cast<std::ptrdiff_t>(at), src.end(), window.begin());
+            base += at;
+            at = 0;
+            in->read(window.data() + keep, static_cast<std::streamsize>(window.size() - keep));
+            std::size_t got = static_cast<std::size_t>(in->gcount());
+            if (in->bad())
+            {
+                ffs::ErrorInfo error(ffs::ErrorCategory::IO, ffs::ErrorCode::FILE_READ_ERROR,
+                                     "Failed to read source file: " + filename);
+                error.context = "File: " + filename;
+                error.suggestion = "Ensure the file is not corrupted and you have read permissions";
+                throw ffs::Error(error);
+            }
+            if (got > 0 && *tap)
+            {
+                (*tap)(window.data() + keep, got);
+            }
+            src = std::string_view(window.data(), keep + got);
+            if (got == 0)
+            {
+                in = nullptr;
+            }
+        }
 
-        for (size_t i = 0; i < s.size(); ++i)
+        // '#' runs to the end of the line (the newline itself stays);
+        // '/*' runs to the next '*/', or to the end of an unclosed file
+        void skipComments()
         {
-            if (!inBlock && s[i] == '#')
+            for (;;)
             {
-                while (i < s.size() && s[i] != '\n')
+                if (at < src.size() && src[at] == '#')
                 {
-                    ++i;
+                    while (at < src.size() && src[at] != '\n')
+                    {
+                        step();
+                    }
                 }
-                if (i < s.size())
+                else if (at + 1 < src.size() && src[at] == '/' && src[at + 1] == '*')
                 {
-                    out.push_back('\n');
+                    step();
+                    step();
+                    while (at < src.size() && !(at + 1 < src.size() && src[at] == '*' && src[at + 1] == '/'))
+                    {
+                        step();
+                    }
+                    if (at < src.size())
+                    {
+                        step();
+                        step();
+                    }
+                }
+                else
+                {
+                    return;
                 }
-                continue;
             }
-            if (!inBlock && i + 1 < s.size() && s[i] == '/' && s[i + 1] == '*')
+        }
+
+        std::string_view src;           // the whole source, or the current window of a stream
+        std::istream *in = nullptr;     // null once the stream is exhausted
+        const SourceTap *tap = nullptr;
+        std::vector<char> window;
+        const std::string &filename;
+        std::size_t base = 0;           // offset of src[0] in the source
+        std::size_t at = 0;
+        std::uint32_t line = 1;
+        std::uint32_t column = 1;
+    };
+
+    bool is_ident(char32_t c)
+    {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-';
+    }
+
+    int digit_value(char c)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            return c - '0';
+        }
+        if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+        {
+            return (c | 0x20) - 'a' + 10;
+        }
+        return -1;
+    }
+
+    // Cell arithmetic is modulo 2^cellBits; the mask is that modulus - 1
+    std::uint32_t cell_mask(int cellBits)
+    {
+        return cellBits >= 32 ? 0xFFFFFFFFu : (1u << cellBits) - 1;
+    }
+
+    // Value of an '=' operand: decimal, 0x hex or b binary. Like strtoul,
+    // digits are read up to the first character that is not one in the base.
+    // It has to fit a cell.
+    long long parse_number(std::string_view s, const ffs::SourceLocation &loc, std::uint32_t mask)
+    {
+        int base = 10;
+        std::size_t at = 0;
+        if (s.size() >= 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+        {
+            if (s.size() == 2)
             {
-                inBlock = true;
-                ++i;
-                continue;
+                ffs::ErrorReporter::syntaxError(ffs::ErrorCode::EMPTY_NUMBER,
+                                                "Hexadecimal number missing digits after '0x'",
+                                                loc,
+                                                "Add hex digits after '0x', e.g., '0xFF' or '0x42'");
             }
-            if (inBlock && i + 1 < s.size() && s[i] == '*' && s[i + 1] == '/')
+            base = 16;
+            at = 2;
+            // strtoul would accept a second prefix too: '0x0x1F'
+            if (s.size() > at + 2 && s[at] == '0' && (s[at + 1] == 'x' || s[at + 1] == 'X') &&
+                digit_value(s[at + 2]) >= 0)
             {
-                inBlock = false;
-                ++i;
-                continue;
+                at += 2;
             }
-            if (!inBlock)
+        }
+        else if (s[0] == 'b' || s[0] == 'B')
+        {
+            if (s.size() == 1)
             {
-                out.push_back(s[i]);
+                ffs::ErrorReporter::syntaxError(ffs::ErrorCode::EMPTY_NUMBER,
+                                                "Binary number missing digits after 'b'",
+                                                loc,
+                                                "Add binary digits after 'b', e.g., 'b1010' or 'B101'");
             }
+            base = 2;
+            at = 1;
+        }
+
+        unsigned long val = 0;
+        std::size_t digits = 0;
+        bool overflow = false;
+        for (; at < s.size(); ++at, ++digits)
+        {
+            int d = digit_value(s[at]);
+            if (d < 0 || d >= base)
+            {
+                break;
+            }
+            if (val > (ULONG_MAX - static_cast<unsigned long>(d)) / static_cast<unsigned long>(base))
+            {
+                overflow = true;
+            }
+            val = val * static_cast<unsigned long>(base) + static_cast<unsigned long>(d);
+        }
+        if (digits == 0 || overflow)
+        {
+            ffs::ErrorReporter::syntaxError(ffs::ErrorCode::INVALID_NUMBER_FORMAT,
+                                            "Invalid number format: " + std::string(s),
+                                            loc,
+                                            "Use decimal (123), hex (0xFF), or binary (b1010) format");
+        }
+        if (val > mask)
+        {
+            const std::string max = std::to_string(mask);
+            ffs::ErrorReporter::syntaxError(ffs::ErrorCode::OUT_OF_RANGE,
+                                            "Number " + std::to_string(val) + " exceeds " +
+                                                (mask == 0xFF ? "byte" : "cell") + " range (0-" + max + ")",
+                                            loc,
+                                            "Use a number between 0 and " + max +
+                                                ", consider using multiple cells or a wider --cell-bits");
+        }
+        return static_cast<long long>(val);
+    }
+
+    // Signed displacement carried by a cell or pointer op
+    long long delta_of(const Instr &ins)
+    {
+        switch (ins.op)
+        {
+        case Op::INC:
+        case Op::INC_PTR:
+            return ins.arg;
+        case Op::DEC:
+        case Op::DEC_PTR:
+            return -static_cast<long long>(ins.arg);
+        default:
+            return 0;
         }
+    }
 
-        return out;
+    bool is_cell_delta(Op op)
+    {
+        return op == Op::INC || op == Op::DEC;
     }
 
-    bool is_ident(char32_t c)
+    bool is_ptr_delta(Op op)
     {
-        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-';
+        return op == Op::INC_PTR || op == Op::DEC_PTR;
     }
 
-    int parse_number(const std::string &s, const std::string &filename = "", size_t position = 0)
+    // Append `count` executions of `ins` as a single instruction. Runs of
+    // '+'/'-' fold into the previous instruction as one net delta, as do runs
+    // of '>' or '<', and consecutive '.'/',' share one count operand. Cell
+    // ops only fold with one addressing the same offset.
+    void emit(std::vector<Instr> &code, const Instr &ins, int count, std::uint32_t mask)
     {
-        try
+        if (count <= 0)
         {
-            unsigned long val;
-            if (s.rfind("0x", 0) == 0 || s.rfind("0X", 0) == 0)
+            return;
+        }
+
+        if (is_cell_delta(ins.op) || is_ptr_delta(ins.op))
+        {
+            const bool cells = is_cell_delta(ins.op);
+            long long delta = delta_of(ins) * count;
+            // Opposing pointer moves are kept apart: clamp and strict mode act
+            // on the intermediate position, so only same-direction runs fold
+            if (!code.empty() && (cells ? is_cell_delta(code.back().op) : code.back().op == ins.op) &&
+                code.back().offset == ins.offset)
             {
-                if (s.length() <= 2)
+                long long merged = delta + delta_of(code.back());
+                if (cells || (merged >= -INT_MAX && merged <= INT_MAX))
                 {
-                    ffs::SourceLocation loc(1, 1, position, filename);
-                    ffs::ErrorReporter::syntaxError(ffs::ErrorCode::EMPTY_NUMBER,
-                                                    "Hexadecimal number missing digits after '0x'",
-                                                    loc,
-                                                    "Add hex digits after '0x', e.g., '0xFF' or '0x42'");
+                    delta = merged;
+                    code.pop_back();
                 }
-                val = std::stoul(s.substr(2), nullptr, 16);
             }
-            else if (s.rfind('b', 0) == 0 || s.rfind('B', 0) == 0)
+            if (cells)
             {
-                if (s.length() <= 1)
+                // Cells wrap, so only the residue matters. With 32-bit cells
+                // it can still be out of int range; the other way round is not.
+                const long long modulus = static_cast<long long>(mask) + 1;
+                delta %= modulus;
+                if (delta > INT_MAX)
+                {
+                    delta -= modulus;
+                }
+                else if (delta < -INT_MAX)
                 {
-                    ffs::SourceLocation loc(1, 1, position, filename);
-                    ffs::ErrorReporter::syntaxError(ffs::ErrorCode::EMPTY_NUMBER,
-                                                    "Binary number missing digits after 'b'",
-                                                    loc,
-                                                    "Add binary digits after 'b', e.g., 'b1010' or 'B101'");
+                    delta += modulus;
                 }
-                val = std::stoul(s.substr(1), nullptr, 2);
+            }
+            if (delta == 0)
+            {
+                return;
+            }
+            Op up = cells ? Op::INC : Op::INC_PTR;
+            Op down = cells ? Op::DEC : Op::DEC_PTR;
+            code.push_back({delta > 0 ? up : down, static_cast<int>(delta > 0 ? delta : -delta), ins.offset});
+            return;
+        }
+
+        switch (ins.op)
+        {
+        case Op::OUT:
+        case Op::IN:
+            if (!code.empty() && code.back().op == ins.op && code.back().offset == ins.offset &&
+                code.back().arg <= INT_MAX - count)
+            {
+                code.back().arg += count;
             }
             else
             {
-                val = std::stoul(s, nullptr, 10);
+                code.push_back({ins.op, count, ins.offset});
+            }
+            break;
+        case Op::ZERO_IF_EOF:
+            // Idempotent: one is as good as many
+            if (code.empty() || code.back().op != Op::ZERO_IF_EOF || code.back().offset != ins.offset)
+            {
+                code.push_back(ins);
+            }
+            break;
+        default:
+            // Jumps and debug dumps stay distinct instructions
+            for (int k = 0; k < count; ++k)
+            {
+                code.push_back(ins);
             }
+            break;
+        }
+    }
+
+    // Until link_jumps() runs, the arg of a JZ/JNZ holds its loop label as an
+    // index into the label table (NO_LABEL for a plain bracket), which lets
+    // the passes compare labels without carrying strings per instruction.
+    // Its otherwise unused offset indexes the bracket's source position.
+    constexpr std::int32_t NO_LABEL = 0;
+
+    bool is_number_char(char c)
+    {
+        return digit_value(c) >= 0 || c == 'x' || c == 'X' || c == 'b' || c == 'B';
+    }
 
-            if (val > 255)
+    // Append an already-desugared instruction, re-folding it into its
+    // neighbour where the rewrite made two runs adjacent
+    void append(std::vector<Instr> &code, const Instr &ins, std::uint32_t mask)
+    {
+        switch (ins.op)
+        {
+        case Op::INC:
+        case Op::DEC:
+        case Op::INC_PTR:
+        case Op::DEC_PTR:
+        case Op::OUT:
+        case Op::IN:
+            emit(code, {ins.op, 1, ins.offset}, ins.arg, mask);
+            break;
+        case Op::CLEAR:
+            // Whatever was written to the cell just before is overwritten
+            while (!code.empty() && (is_cell_delta(code.back().op) || code.back().op == Op::CLEAR) &&
+                   code.back().offset == ins.offset)
             {
-                ffs::SourceLocation loc(1, 1, position, filename);
-                ffs::ErrorReporter::syntaxError(ffs::ErrorCode::OUT_OF_RANGE,
-                                                "Number " + std::to_string(val) + " exceeds byte range (0-255)",
-                                                loc,
-                                                "Use a number between 0 and 255, or consider using multiple cells");
+                code.pop_back();
             }
-            return static_cast<int>(val);
+            code.push_back(ins);
+            break;
+        default:
+            code.push_back(ins);
+            break;
         }
-        catch (const std::exception &)
+    }
+
+    // Multiplicative inverse of an odd value modulo mask + 1. Newton's step
+    // doubles the number of correct low bits, and d is its own inverse mod 8,
+    // so four steps cover 32 bits.
+    std::uint32_t inverse_mod(std::uint32_t d, std::uint32_t mask)
+    {
+        std::uint32_t x = d;
+        for (int i = 0; i < 4; ++i)
         {
-            ffs::SourceLocation loc(1, 1, position, filename);
-            ffs::ErrorReporter::syntaxError(ffs::ErrorCode::INVALID_NUMBER_FORMAT,
-                                            "Invalid number format: " + s,
-                                            loc,
-                                            "Use decimal (123), hex (0xFF), or binary (b1010) format");
+            x *= 2 - d * x;
         }
+        return x & mask;
     }
 
-    std::vector<Instr> desugar(const std::string &src, int dbgWidth, const std::string &filename = "")
+    // Try to replace the innermost loop code[open..close] with an idiom op.
+    // Returns false when the body is not one we know how to rewrite. The
+    // offsets the body walks between go to lo and hi.
+    bool rewrite_loop(std::vector<Instr> &out, const std::vector<Instr> &code, size_t open, size_t close,
+                      std::uint32_t mask, long long &lo, long long &hi)
     {
-        std::vector<Instr> code;
-        auto skipws = [&](size_t &i)
+        lo = hi = 0;
+        // [>] / [<] / [>x4] - scan for the next zero cell at a fixed stride
+        if (close == open + 2 && is_ptr_delta(code[open + 1].op))
+        {
+            const Instr &mv = code[open + 1];
+            append(out, {Op::SCAN, mv.op == Op::INC_PTR ? mv.arg : -mv.arg}, mask);
+            return true;
+        }
+
+        // Bodies made only of cell and pointer deltas that return to where
+        // they started: [-], [->+<], [->++>+++<<], ...
+        std::map<long long, long long> deltas;
+        long long pos = 0;
+        for (size_t k = open + 1; k < close; ++k)
         {
-            while (i < src.size() && std::isspace(static_cast<unsigned char>(src[i])))
+            const Instr &ins = code[k];
+            if (is_ptr_delta(ins.op))
             {
-                ++i;
+                pos += delta_of(ins);
+                lo = std::min(lo, pos);
+                hi = std::max(hi, pos);
             }
-        };
+            else if (is_cell_delta(ins.op))
+            {
+                deltas[pos] = (deltas[pos] + delta_of(ins)) & mask;
+            }
+            else
+            {
+                return false;
+            }
+        }
 
-        for (size_t i = 0; i < src.size();)
+        // The loop counter must reach zero whatever its start value, which
+        // only holds for an odd step
+        long long step = deltas[0];
+        if (pos != 0 || (step & 1) == 0)
         {
-            skipws(i);
-            if (i >= src.size())
+            return false;
+        }
+        // Every cell the body walks over at its extremes must be one it
+        // writes, so bounds are checked on the same cells the loop touched
+        if ((lo != 0 && deltas[lo] == 0) || (hi != 0 && deltas[hi] == 0))
+        {
+            return false;
+        }
+
+        // The loop runs n times with v + n*step == 0 (mod 2^bits), so each
+        // target gains v * (-step^-1 * delta). A 32-bit factor is stored
+        // as its bit pattern.
+        std::uint64_t scale = (0u - inverse_mod(static_cast<std::uint32_t>(step), mask)) & mask;
+        for (const auto &[off, delta] : deltas)
+        {
+            if (off == 0 || delta == 0)
+            {
+                continue;
+            }
+            auto factor = static_cast<std::uint32_t>((static_cast<std::uint64_t>(delta) * scale) & mask);
+            out.push_back({Op::MUL_ADD, static_cast<std::int32_t>(factor), static_cast<std::int32_t>(off)});
+        }
+        append(out, {Op::CLEAR, 0}, mask);
+        return true;
+    }
+
+    // Rewrite an innermost loop whose body leaves the pointer where it found
+    // it, so the body addresses its cells as ptr + offset instead of moving:
+    // [>+>.<<-] runs as INC@1 OUT@2 DEC@0. Only the loop test reads the
+    // pointer, and that is back at offset 0 on every iteration. The walk's
+    // extremes go to lo and hi, as for rewrite_loop.
+    bool address_loop(std::vector<Instr> &out, const std::vector<Instr> &code, size_t open, size_t close,
+                      std::uint32_t mask, long long &lo, long long &hi)
+    {
+        std::vector<Instr> body;
+        long long pos = 0;
+        lo = hi = 0;
+        long long touchedLo = 0; // the loop test reads offset 0
+        long long touchedHi = 0;
+        for (size_t k = open + 1; k < close; ++k)
+        {
+            const Instr &ins = code[k];
+            if (is_ptr_delta(ins.op))
             {
+                pos += delta_of(ins);
+                if (pos < INT_MIN || pos > INT_MAX)
+                {
+                    return false;
+                }
+                lo = std::min(lo, pos);
+                hi = std::max(hi, pos);
+                continue;
+            }
+            switch (ins.op)
+            {
+            case Op::INC:
+            case Op::DEC:
+            case Op::OUT:
+            case Op::IN:
+            case Op::ZERO_IF_EOF:
+                body.push_back({ins.op, ins.arg, static_cast<std::int32_t>(pos)});
+                touchedLo = std::min(touchedLo, pos);
+                touchedHi = std::max(touchedHi, pos);
                 break;
+            default:
+                // '!' reports the pointer, so a body with one keeps its moves
+                return false;
             }
-            char c = src[i];
+        }
+        // As in rewrite_loop, the cells at the extremes of the walk must be
+        // ones the body touches, so bounds are checked on the same cells
+        if (pos != 0 || (lo == 0 && hi == 0) || lo != touchedLo || hi != touchedHi)
+        {
+            return false;
+        }
+
+        append(out, code[open], mask);
+        for (const auto &ins : body)
+        {
+            append(out, ins, mask);
+        }
+        append(out, code[close], mask);
+        return true;
+    }
+
+    // Peephole pass over the unlinked program, fed one instruction at a
+    // time: recognises clear, multiply and scan loops, addresses the
+    // bodies of other balanced loops by offset and folds the runs the
+    // rewrites leave adjacent. Only the innermost loop still open is held
+    // back, since only it can turn out to be rewritable.
+    class Optimizer
+    {
+    public:
+        explicit Optimizer(std::uint32_t mask) : mask(mask)
+        {
+        }
 
-            auto parseRepeat = [&](size_t &j) -> int
+        void push(const Instr &ins)
+        {
+            if (ins.op == Op::JZ)
+            {
+                // The loop held back so far has a nested one, so it stays
+                release();
+                held.push_back(ins);
+            }
+            else if (held.empty())
             {
-                if (j < src.size() && src[j] == 'x')
+                append(out, ins, mask);
+            }
+            else
+            {
+                held.push_back(ins);
+                if (ins.op == Op::JNZ)
                 {
-                    size_t k = j + 1;
-                    while (k < src.size() && std::isdigit(static_cast<unsigned char>(src[k])))
+                    if (ins.arg == held.front().arg && rewrite())
                     {
-                        ++k;
+                        held.clear();
                     }
-                    if (k > j + 1)
+                    else
                     {
-                        int n = std::stoi(src.substr(j + 1, k - (j + 1)));
-                        j = k;
-                        return n;
+                        release();
                     }
                 }
-                return 1;
-            };
+            }
+        }
+
+        std::vector<Instr> finish()
+        {
+            release();
+            return std::move(out);
+        }
+
+    private:
+        // Emit the held loop as an idiom or with its body addressed by
+        // offset. A body that walks away from the loop cell is guarded at
+        // both ends of the walk, with the loop as written behind it for
+        // runs that start near an edge (see Instr).
+        bool rewrite()
+        {
+            const std::size_t close = held.size() - 1;
+            long long lo = 0;
+            long long hi = 0;
+            rewritten.clear();
+            if (!rewrite_loop(rewritten, held, 0, close, mask, lo, hi) &&
+                !address_loop(rewritten, held, 0, close, mask, lo, hi))
+            {
+                return false;
+            }
+            const std::size_t guards = out.size();
+            for (long long end : {lo, hi})
+            {
+                if (end != 0)
+                {
+                    out.push_back({Op::GUARD, 0, static_cast<std::int32_t>(end)});
+                }
+            }
+            const std::size_t body = out.size();
+            for (const auto &ins : rewritten)
+            {
+                append(out, ins, mask);
+            }
+            if (body > guards)
+            {
+                // Relative until link_jumps() makes them absolute
+                for (std::size_t k = guards; k < body; ++k)
+                {
+                    out[k].arg = static_cast<std::int32_t>(out.size() - k);
+                }
+                out.insert(out.end(), held.begin(), held.end());
+            }
+            return true;
+        }
+
+        void release()
+        {
+            for (const auto &ins : held)
+            {
+                append(out, ins, mask);
+            }
+            held.clear();
+        }
+
+        std::vector<Instr> out;
+        std::vector<Instr> held; // from the innermost open JZ on
+        std::vector<Instr> rewritten;
+        std::uint32_t mask;
+    };
+
+    void flush(Optimizer &opt, std::vector<Instr> &code, std::size_t count)
+    {
+        for (std::size_t k = 0; k < count; ++k)
+        {
+            opt.push(code[k]);
+        }
+        code.erase(code.begin(), code.begin() + static_cast<std::ptrdiff_t>(count));
+    }
+
+    // One pass over the source: comments, sugar and repeat counts are
+    // resolved as they are read, with no per-token allocation. Instructions
+    // are handed on to `opt` as soon as nothing later can fold into them.
+    void desugar(Lexer &lex, int dbgWidth, std::uint32_t mask, std::vector<std::string> &labels,
+                 std::vector<SourcePos> &brackets, Optimizer &opt)
+    {
+        // Only the last instruction can still absorb what comes next
+        std::vector<Instr> code;
+        labels.assign(1, "");
+        brackets.clear();
+        std::unordered_map<std::string, std::int32_t> labelIds;
+        std::string text; // label or number being read, reused throughout
+
+        auto bracket = [&](Op op, std::int32_t label, SourcePos pos)
+        {
+            brackets.push_back(pos);
+            return Instr{op, label, static_cast<std::int32_t>(brackets.size() - 1)};
+        };
+
+        while (!lex.done())
+        {
+            if (code.size() > 1)
+            {
+                flush(opt, code, code.size() - 1);
+            }
+            char c = lex.peek();
+            SourcePos pos = lex.position();
 
             if (c == '>' || c == '<' || c == '+' || c == '-' || c == '.' || c == ',' || c == '[' || c == ']' ||
                 c == '?' || c == '!')
             {
-                if ((c == '[' || c == ']') && i + 1 < src.size() && src[i + 1] == '@')
+                lex.advance();
+                if ((c == '[' || c == ']') && !lex.done() && lex.peek() == '@')
                 {
-                    size_t j = i + 2;
-                    while (j < src.size() && is_ident(src[j]))
+                    lex.advance();
+                    text.clear();
+                    while (!lex.done() && is_ident(lex.peek()))
                     {
-                        ++j;
+                        text.push_back(lex.peek());
+                        lex.advance();
                     }
-                    std::string name = src.substr(i + 2, j - (i + 2));
-                    if (name.empty())
+                    // A bare '[@' is not a bracket at all
+                    if (text.empty())
                     {
-                        ++i;
                         continue;
                     }
-                    Instr ins;
-                    ins.op = (c == '[') ? Op::JZ : Op::JNZ;
-                    ins.label = name;
-                    code.push_back(ins);
-                    i = j;
+                    auto it = labelIds.find(text);
+                    if (it == labelIds.end())
+                    {
+                        it = labelIds.emplace(text, static_cast<std::int32_t>(labels.size())).first;
+                        labels.push_back(text);
+                    }
+                    code.push_back(bracket(c == '[' ? Op::JZ : Op::JNZ, it->second, pos));
                     continue;
                 }
 
@@ -217,10 +736,10 @@ namespace
                     ins.op = Op::IN;
                     break;
                 case '[':
-                    ins.op = Op::JZ;
+                    ins = bracket(Op::JZ, NO_LABEL, pos);
                     break;
                 case ']':
-                    ins.op = Op::JNZ;
+                    ins = bracket(Op::JNZ, NO_LABEL, pos);
                     break;
                 case '?':
                     ins.op = Op::ZERO_IF_EOF;
@@ -232,69 +751,129 @@ namespace
                 default:
                     break;
                 }
-                size_t j = i + 1;
-                int rep = parseRepeat(j);
-                for (int k = 0; k < rep; ++k)
+
+                // Machine-generated code is mostly long runs of one op; they
+                // are counted here rather than emitted char by char. Brackets
+                // are left alone since each keeps its own position.
+                int run = 1;
+                if (ins.op != Op::JZ && ins.op != Op::JNZ)
                 {
-                    code.push_back(ins);
+                    while (!lex.done() && lex.peek() == c && run < INT_MAX)
+                    {
+                        ++run;
+                        lex.advance();
+                    }
                 }
-                i = j;
+                emit(code, ins, run - 1, mask);
+
+                // Optional repeat count for the last one: '+x10'. An 'x'
+                // without digits is just an ignored character.
+                int rep = 1;
+                if (!lex.done() && lex.peek() == 'x')
+                {
+                    lex.advance();
+                    ffs::SourceLocation at = lex.location();
+                    long long n = -1;
+                    while (!lex.done() && lex.peek() >= '0' && lex.peek() <= '9')
+                    {
+                        n = std::max(n, 0LL) * 10 + (lex.peek() - '0');
+                        if (n > INT_MAX)
+                        {
+                            ffs::ErrorReporter::syntaxError(ffs::ErrorCode::INVALID_NUMBER_FORMAT,
+                                                            "Repeat count is too large",
+                                                            at,
+                                                            "Use a count below 2147483648, or split the run");
+                        }
+                        lex.advance();
+                    }
+                    if (n >= 0)
+                    {
+                        rep = static_cast<int>(n);
+                    }
+                }
+                emit(code, ins, rep, mask);
                 continue;
             }
 
             if (c == '=')
             {
-                size_t j = i + 1;
-                auto isNum = [&](char ch)
-                {
-                    return std::isdigit(static_cast<unsigned char>(ch)) || ch == 'x' || ch == 'X' || ch == 'b' ||
-                           ch == 'B' || (ch >= 'a' && ch <= 'f') || (ch >= 'A' && ch <= 'F');
-                };
-                while (j < src.size() && isNum(src[j]))
+                lex.advance();
+                ffs::SourceLocation at = lex.location();
+                text.clear();
+                while (!lex.done() && is_number_char(lex.peek()))
                 {
-                    ++j;
+                    text.push_back(lex.peek());
+                    lex.advance();
                 }
-                std::string num = src.substr(i + 1, j - (i + 1));
-                if (!num.empty())
+                if (!text.empty())
                 {
-                    code.push_back({Op::CLEAR, 0, ""});
-                    code.push_back({Op::INC, parse_number(num, filename, i + 1), ""});
+                    code.push_back({Op::CLEAR, 0});
+                    // Counts are ints, so the top half of a 32-bit cell is
+                    // reached by counting down from zero
+                    long long value = parse_number(text, at, mask);
+                    if (value > INT_MAX)
+                    {
+                        emit(code, {Op::DEC, 1}, static_cast<int>(static_cast<long long>(mask) + 1 - value), mask);
+                    }
+                    else
+                    {
+                        emit(code, {Op::INC, 1}, static_cast<int>(value), mask);
+                    }
                 }
-                i = j;
                 continue;
             }
 
             if (c == ':')
             {
-                size_t j = i + 1;
-                while (j < src.size() && is_ident(src[j]))
+                // Label definitions are accepted and ignored
+                lex.advance();
+                while (!lex.done() && is_ident(lex.peek()))
                 {
-                    ++j;
+                    lex.advance();
                 }
-                i = j;
                 continue;
             }
 
-            ++i;
+            // Whitespace and anything else that is not an op
+            lex.advance();
         }
 
-        return code;
+        flush(opt, code, code.size());
     }
 
-    void link_jumps(std::vector<Instr> &code)
+    // Resolve each JZ/JNZ label id into its partner's pc and each GUARD's
+    // distance into a pc, keeping the loop names and bracket positions in
+    // the debug side table
+    void link_jumps(std::vector<Instr> &code, const std::vector<std::string> &labels,
+                    const std::vector<SourcePos> &brackets, const std::string &filename, DebugInfo &debug)
     {
         struct Frame
         {
             int pc;
-            std::string tag;
+            std::int32_t tag;
+        };
+
+        auto location = [&](int pc)
+        {
+            const SourcePos &pos = debug.positions[pc];
+            return ffs::SourceLocation(pos.line, pos.column, 0, filename);
         };
 
         std::vector<Frame> st;
         for (int i = 0; i < static_cast<int>(code.size()); ++i)
         {
+            if (code[i].op == Op::GUARD)
+            {
+                code[i].arg += i;
+            }
+            if (code[i].op == Op::JZ || code[i].op == Op::JNZ)
+            {
+                debug.positions[i] = brackets[static_cast<std::size_t>(code[i].offset)];
+                code[i].offset = 0;
+            }
             if (code[i].op == Op::JZ)
             {
-                st.push_back({i, code[i].label});
+                st.push_back({i, code[i].arg});
             }
             else if (code[i].op == Op::JNZ)
             {
@@ -302,20 +881,22 @@ namespace
                 {
                     ffs::ErrorReporter::syntaxError(ffs::ErrorCode::UNMATCHED_BRACKET,
                                                     "Found ']' without matching '['",
-                                                    {},
+                                                    location(i),
                                                     "Add a '[' before this ']' or remove the extra ']'");
                 }
                 auto top = st.back();
                 st.pop_back();
-                if (top.tag != code[i].label)
+                if (top.tag != code[i].arg)
                 {
-                    if (!(top.tag.empty() && code[i].label.empty()))
-                    {
-                        ffs::ErrorReporter::syntaxError(ffs::ErrorCode::MISMATCHED_LABELS,
-                                                        "Mismatched labels between '[" + top.tag + "]' and '[" + code[i].label + "]'",
-                                                        {},
-                                                        "Make sure labeled brackets match: [name] ... ]name");
-                    }
+                    ffs::ErrorReporter::syntaxError(ffs::ErrorCode::MISMATCHED_LABELS,
+                                                    "Mismatched labels between '[" + labels[top.tag] + "]' and '[" + labels[code[i].arg] + "]'",
+                                                    location(i),
+                                                    "Make sure labeled brackets match: [name] ... ]name");
+                }
+                if (top.tag != NO_LABEL)
+                {
+                    debug.labels[top.pc] = labels[top.tag];
+                    debug.labels[i] = labels[top.tag];
                 }
                 code[top.pc].arg = i;
                 code[i].arg = top.pc;
@@ -325,16 +906,206 @@ namespace
         {
             ffs::ErrorReporter::syntaxError(ffs::ErrorCode::UNMATCHED_BRACKET,
                                             "Found '[' without matching ']'",
-                                            {},
+                                            location(st.back().pc),
                                             "Add a ']' to close this '[' or remove the extra '['");
         }
     }
+
+    // Dataflow over the linked program. Only the cell under the pointer is
+    // described: in clamp mode a move or an offset can land back on a cell
+    // already seen, so no fact survives one. Nothing is known at entry
+    // either, since ffs::Vm runs keep the previous run's tape; the start of
+    // a fresh tape is the compile-time prefix's business. Loops entered on
+    // a known zero are dropped whole, as are
+    // CLEARs of a zero cell and idioms that would do nothing there, and a
+    // CLEAR followed by counts becomes one SET. Jumps and the debug side
+    // table are then remapped onto the shorter code.
+    void fold_known_cells(Program &prog, std::uint32_t mask)
+    {
+        const std::vector<Instr> &code = prog.code;
+        std::vector<Instr> out;
+        std::vector<std::int32_t> moved(code.size(), -1); // new pc of each kept instruction
+        std::vector<bool> guarded(code.size(), false);     // JZs a kept GUARD jumps to
+        out.reserve(code.size());
+
+        bool known = false; // whether cell is the value under the pointer
+        std::uint32_t cell = 0;
+        auto learn = [&](std::uint32_t value)
+        {
+            known = true;
+            cell = value;
+        };
+        auto is = [&](std::uint32_t value) { return known && cell == value; };
+        auto keep = [&](std::size_t pc, const Instr &ins)
+        {
+            moved[pc] = static_cast<std::int32_t>(out.size());
+            out.push_back(ins);
+        };
+
+        for (std::size_t pc = 0; pc < code.size(); ++pc)
+        {
+            const Instr &ins = code[pc];
+            switch (ins.op)
+            {
+            case Op::INC:
+            case Op::DEC:
+                if (ins.offset != 0)
+                {
+                    keep(pc, ins);
+                    known = false;
+                }
+                else if (known)
+                {
+                    auto arg = static_cast<std::uint32_t>(ins.arg);
+                    std::uint32_t value = (ins.op == Op::INC ? cell + arg : cell - arg) & mask;
+                    // Nothing can jump between a store and the count after it
+                    if (!out.empty() && (out.back().op == Op::CLEAR || out.back().op == Op::SET))
+                    {
+                        out.back() = {Op::SET, static_cast<std::int32_t>(value)};
+                    }
+                    else
+                    {
+                        keep(pc, ins);
+                    }
+                    learn(value);
+                }
+                else
+                {
+                    keep(pc, ins);
+                }
+                break;
+            case Op::INC_PTR:
+            case Op::DEC_PTR:
+            case Op::IN:
+                keep(pc, ins);
+                known = false;
+                break;
+            case Op::ZERO_IF_EOF:
+                if (ins.offset == 0 && known && cell != mask)
+                {
+                    break;
+                }
+                keep(pc, ins);
+                if (ins.offset == 0 && known)
+                {
+                    learn(0);
+                }
+                else if (ins.offset != 0)
+                {
+                    known = false;
+                }
+                break;
+            case Op::CLEAR:
+            case Op::SET:
+            {
+                std::uint32_t value = ins.op == Op::SET ? static_cast<std::uint32_t>(ins.arg) & mask : 0;
+                if (!is(value))
+                {
+                    keep(pc, ins);
+                }
+                learn(value);
+                break;
+            }
+            case Op::MUL_ADD:
+                if (!is(0))
+                {
+                    keep(pc, ins);
+                    known = false;
+                }
+                break;
+            case Op::SCAN:
+                if (!is(0))
+                {
+                    keep(pc, ins);
+                }
+                learn(0);
+                break;
+            case Op::GUARD:
+                if (is(0))
+                {
+                    // Guards, rewritten loop and the loop as written all
+                    // leave a zero cell alone
+                    pc = static_cast<std::size_t>(code[static_cast<std::size_t>(ins.arg)].arg);
+                    break;
+                }
+                keep(pc, ins);
+                guarded[static_cast<std::size_t>(ins.arg)] = true;
+                break;
+            case Op::JZ:
+                if (is(0) && !guarded[pc])
+                {
+                    // Never entered; the cell is still zero after it
+                    pc = static_cast<std::size_t>(ins.arg);
+                    break;
+                }
+                keep(pc, ins);
+                known = false; // the body is also reached from its back-edge
+                break;
+            case Op::JNZ:
+                keep(pc, ins);
+                learn(0);
+                break;
+            case Op::OUT:
+            case Op::DBG:
+                keep(pc, ins);
+                break;
+            }
+        }
+
+        for (auto &ins : out)
+        {
+            if (ins.op == Op::JZ || ins.op == Op::JNZ || ins.op == Op::GUARD)
+            {
+                ins.arg = moved[static_cast<std::size_t>(ins.arg)];
+            }
+        }
+        DebugInfo debug;
+        for (const auto &[pc, name] : prog.debug.labels)
+        {
+            if (moved[static_cast<std::size_t>(pc)] >= 0)
+            {
+                debug.labels.emplace(moved[static_cast<std::size_t>(pc)], name);
+            }
+        }
+        for (const auto &[pc, pos] : prog.debug.positions)
+        {
+            if (moved[static_cast<std::size_t>(pc)] >= 0)
+            {
+                debug.positions.emplace(moved[static_cast<std::size_t>(pc)], pos);
+            }
+        }
+        prog.code = std::move(out);
+        prog.debug = std::move(debug);
+    }
 } // namespace
 
-Program compile_src(const std::string &raw, int dbgWidth, const std::string &filename)
+namespace
+{
+    Program compile(Lexer &lex, int dbgWidth, int cellBits, const std::string &filename)
+    {
+        std::vector<std::string> labels;
+        std::vector<SourcePos> brackets;
+        Optimizer opt(cell_mask(cellBits));
+        desugar(lex, dbgWidth, cell_mask(cellBits), labels, brackets, opt);
+        Program prog;
+        prog.cellBits = cellBits;
+        prog.code = opt.finish();
+        link_jumps(prog.code, labels, brackets, filename, prog.debug);
+        fold_known_cells(prog, cell_mask(cellBits));
+        evaluate_prefix(prog);
+        return prog;
+    }
+} // namespace
+
+Program compile_src(const std::string &raw, int dbgWidth, int cellBits, const std::string &filename)
+{
+    Lexer lex(raw, filename);
+    return compile(lex, dbgWidth, cellBits, filename);
+}
+
+Program compile_stream(std::istream &in, int dbgWidth, int cellBits, const std::string &filename,
+                       const SourceTap &tap)
 {
-    std::string noCom = strip_comments(raw);
-    auto code = desugar(noCom, dbgWidth, filename);
-    link_jumps(code);
-    return Program{std::move(code)};
+    Lexer lex(in, filename, tap);
+    return compile(lex, dbgWidth, cellBits, filename);
 }
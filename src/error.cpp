@@ -25,7 +25,7 @@ namespace ffs {
         ErrorInfo error(ErrorCategory::SYNTAX, code, message);
         error.location   = loc;
         error.suggestion = suggestion;
-        fatal(error);
+        throw Error(error);
     }
 
     void ErrorReporter::runtimeError (ErrorCode          code, const std::string &   message,
@@ -33,7 +33,7 @@ namespace ffs {
         ErrorInfo error(ErrorCategory::RUNTIME, code, message);
         error.context    = context;
         error.suggestion = suggestion;
-        fatal(error);
+        throw Error(error);
     }
 
     void ErrorReporter::argumentError (ErrorCode          code, const std::string &message,
@@ -136,10 +136,16 @@ namespace ffs {
                 return "memory-limit";
             case ErrorCode::INVALID_JUMP_TARGET:
                 return "invalid-jump";
+            case ErrorCode::STEP_LIMIT_EXCEEDED:
+                return "step-limit";
+            case ErrorCode::TIMEOUT:
+                return "timeout";
             case ErrorCode::FILE_NOT_FOUND:
                 return "file-not-found";
             case ErrorCode::FILE_READ_ERROR:
                 return "file-read-error";
+            case ErrorCode::FILE_WRITE_ERROR:
+                return "file-write-error";
             case ErrorCode::INVALID_ARGUMENT_VALUE:
                 return "invalid-value";
             case ErrorCode::MISSING_ARGUMENT_VALUE:
@@ -0,0 +1,74 @@
+#include "ffs.h"
+
+#include "compiler.h"
+
+#include <exception>
+#include <utility>
+
+namespace ffs {
+    Vm::Vm (const RunOptions &opts)
+        : opts(opts), memory(opts.cells, opts.maxCells, opts.elastic, opts.strict, opts.cellBits),
+          in(new InputSource(stdin)), out(new OutputBuffer(stdout, opts.flush)) {
+    }
+
+    void Vm::setInput (FILE *file) {
+        in.reset(new InputSource(file));
+    }
+
+    void Vm::setInput (InputFeed feed) {
+        in.reset(new InputSource(std::move(feed)));
+    }
+
+    void Vm::setOutput (FILE *file) {
+        out.reset(new OutputBuffer(file, opts.flush));
+    }
+
+    void Vm::setOutput (OutputSink sink) {
+        out.reset(new OutputBuffer(std::move(sink), opts.flush));
+    }
+
+    void Vm::setDebugStream (FILE *file) {
+        err = file;
+    }
+
+    void Vm::setLimits (std::uint64_t maxSteps, double timeoutSeconds) {
+        opts.maxSteps = maxSteps;
+        opts.timeout  = timeoutSeconds;
+    }
+
+    Result Vm::run (const Program &p) {
+        Result result;
+        in->rebase();
+        try {
+            result.status = execute(p, opts, memory, *in, *out, err, &result.steps);
+        } catch (const Error &e) {
+            result.status = 1;
+            result.error  = e.info();
+        } catch (const std::exception &e) {
+            result.status = 1;
+            result.error  = ErrorInfo(ErrorCategory::INTERNAL, ErrorCode::INTERNAL_ERROR, e.what());
+        }
+        // Output produced before a failure is still delivered, and a FILE
+        // input is left just past what the program read
+        out->flush();
+        in->sync();
+        return result;
+    }
+
+    Result Vm::run (const std::string &src, const std::string &filename) {
+        Program p;
+        try {
+            p = compile_src(src, opts.dbgWidth, opts.cellBits, filename);
+        } catch (const Error &e) {
+            Result result;
+            result.status = 1;
+            result.error  = e.info();
+            return result;
+        }
+        return run(p);
+    }
+
+    void Vm::reset () {
+        memory.reset();
+    }
+} // namespace ffs
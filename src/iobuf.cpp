@@ -0,0 +1,260 @@
+#include "iobuf.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <utility>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    // The stream's own position, which counts what stdio has buffered;
+    // -1 when it cannot seek (pipes, terminals)
+    std::int64_t tell (FILE *f) {
+#ifdef _WIN32
+        return _ftelli64(f);
+#else
+        return static_cast<std::int64_t>(ftello(f));
+#endif
+    }
+
+    // Moves the stream and its descriptor, which the reads below go through.
+    // fseeko alone may only move within stdio's buffer; fflush on an input
+    // stream then puts the descriptor at the stream's position.
+    bool seek (FILE *f, std::int64_t offset) {
+#ifdef _WIN32
+        return _fseeki64(f, offset, SEEK_SET) == 0 && _lseeki64(_fileno(f), offset, SEEK_SET) == offset;
+#else
+        return fseeko(f, static_cast<off_t>(offset), SEEK_SET) == 0 && std::fflush(f) == 0;
+#endif
+    }
+} // namespace
+
+OutputBuffer::OutputBuffer (FILE *out, FlushMode mode)
+    : out(out), mode(mode), buf(new std::uint8_t[CAPACITY]) {
+    if (this->mode == FlushMode::AUTO) {
+        this->mode = is_interactive(out) ? FlushMode::LINE : FlushMode::BLOCK;
+    }
+#ifndef _WIN32
+    // An append-mode stream writes at the end of the file, wherever its
+    // offset points until then
+    struct stat st{};
+    int         fd = out != nullptr ? fileno(out) : -1;
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        int   flags = fcntl(fd, F_GETFL);
+        off_t at    = flags >= 0 && (flags & O_APPEND) != 0 ? st.st_size : lseek(fd, 0, SEEK_CUR);
+        start       = at > 0 ? static_cast<std::uint64_t>(at) : 0;
+    }
+#endif
+}
+
+OutputBuffer::OutputBuffer (OutputSink sink, FlushMode mode)
+    : sink(std::move(sink)), mode(mode == FlushMode::AUTO ? FlushMode::BLOCK : mode), buf(new std::uint8_t[CAPACITY]) {
+}
+
+OutputBuffer::~OutputBuffer () {
+    flush();
+}
+
+void OutputBuffer::putSlow (std::uint8_t byte, int count) {
+    while (count > 0) {
+        if (len == CAPACITY) {
+            drain();
+        }
+        std::size_t n = std::min(CAPACITY - len, static_cast<std::size_t>(count));
+        std::fill_n(buf.get() + len, n, byte);
+        len += n;
+        count -= static_cast<int>(n);
+    }
+}
+
+void OutputBuffer::drain () {
+    if (len > 0) {
+        if (sink) {
+            sink(buf.get(), len);
+        } else {
+            std::fwrite(buf.get(), 1, len, out);
+        }
+        total += len;
+        len = 0;
+    }
+}
+
+void OutputBuffer::flush () {
+    drain();
+    if (out != nullptr) {
+        std::fflush(out);
+    }
+}
+
+void OutputBuffer::resumeAt (std::uint64_t origin, std::uint64_t offset) {
+    flush();
+    start = origin;
+    total = offset;
+#ifndef _WIN32
+    struct stat         st{};
+    int                 fd  = out != nullptr ? fileno(out) : -1;
+    const std::uint64_t end = origin + offset;
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && static_cast<std::uint64_t>(st.st_size) >= end &&
+        ftruncate(fd, static_cast<off_t>(end)) == 0) {
+        std::fseek(out, static_cast<long>(end), SEEK_SET);
+    }
+#endif
+}
+
+InputSource::InputSource (FILE *in)
+#ifdef _WIN32
+    : fd(_fileno(in)), file(in), tty(is_interactive(in)) {
+#else
+    : fd(fileno(in)), file(in), tty(is_interactive(in)) {
+#endif
+    // Start where stdio says the stream is, not where its read-ahead left
+    // the descriptor
+    std::int64_t at = tty ? -1 : tell(in);
+    if (at >= 0 && seek(in, at)) {
+        seekable = true;
+        start    = at;
+    }
+#ifndef _WIN32
+    // A regular file is mapped whole and read straight from the page cache
+    struct stat st{};
+    off_t       offset = static_cast<off_t>(start);
+    if (seekable && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > offset) {
+        mapLen   = static_cast<std::size_t>(st.st_size);
+        void *mem = mmap(nullptr, mapLen, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mem != MAP_FAILED) {
+            madvise(mem, mapLen, MADV_SEQUENTIAL);
+            map = mem;
+            cur = window = static_cast<const std::uint8_t *>(mem) + offset;
+            end = static_cast<const std::uint8_t *>(mem) + mapLen;
+        } else {
+            mapLen = 0;
+        }
+    }
+#endif
+}
+
+InputSource::InputSource (InputFeed feed) : feed(std::move(feed)) {
+}
+
+InputSource::~InputSource () {
+    sync();
+#ifndef _WIN32
+    if (map != nullptr) {
+        munmap(map, mapLen);
+    }
+#endif
+}
+
+bool InputSource::refill () {
+    before += static_cast<std::uint64_t>(end - window);
+    window = end;
+    // A mapping already holds the whole file, and EOF is sticky like it is
+    // for a FILE*
+    if (eof || map != nullptr) {
+        eof = true;
+        return false;
+    }
+    if (!chunk) {
+        chunk.reset(new std::uint8_t[CHUNK]);
+    }
+    if (feed) {
+        std::size_t n = feed(chunk.get(), CHUNK);
+        if (n == 0) {
+            eof = true;
+            return false;
+        }
+        cur = window = chunk.get();
+        end = chunk.get() + std::min(n, CHUNK);
+        return true;
+    }
+    // read() returns whatever is available, so pipes and terminals are never
+    // held up waiting for a full chunk
+#ifdef _WIN32
+    int n = _read(fd, chunk.get(), static_cast<unsigned>(CHUNK));
+#else
+    ssize_t n;
+    do {
+        n = read(fd, chunk.get(), CHUNK);
+    } while (n < 0 && errno == EINTR);
+#endif
+    if (n <= 0) {
+        eof = true;
+        return false;
+    }
+    cur = window = chunk.get();
+    end = chunk.get() + n;
+    return true;
+}
+
+int InputSource::getSlow (int count) {
+    int last = EOF;
+    while (count > 0) {
+        if (cur == end && !refill()) {
+            return EOF;
+        }
+        std::size_t n = std::min(static_cast<std::size_t>(end - cur), static_cast<std::size_t>(count));
+        cur += n;
+        count -= static_cast<int>(n);
+        last = cur[-1];
+    }
+    return last;
+}
+
+void InputSource::sync () {
+    if (!seekable) {
+        return;
+    }
+    // Bytes read ahead past the cursor are read again from the descriptor
+    if (map == nullptr) {
+        before += static_cast<std::uint64_t>(cur - window);
+        window = end = cur;
+    }
+    seek(file, start + static_cast<std::int64_t>(consumed()));
+}
+
+void InputSource::rebase () {
+    if (!seekable) {
+        return;
+    }
+    std::int64_t at = tell(file);
+    if (at < 0 || at == start + static_cast<std::int64_t>(consumed())) {
+        return;
+    }
+    // Someone read or seeked through stdio since sync(): carry on from
+    // there, keeping consumed() counting up
+    before += static_cast<std::uint64_t>(cur - window);
+    if (map != nullptr) {
+        cur = window = static_cast<const std::uint8_t *>(map) + std::min(static_cast<std::size_t>(at), mapLen);
+    } else {
+        window = end = cur;
+        seek(file, at);
+    }
+    eof   = false;
+    start = at - static_cast<std::int64_t>(consumed());
+}
+
+void InputSource::skip (std::uint64_t n) {
+    while (n > 0) {
+        if (cur == end && !refill()) {
+            return;
+        }
+        std::size_t step = static_cast<std::size_t>(std::min<std::uint64_t>(n, static_cast<std::uint64_t>(end - cur)));
+        cur += step;
+        n -= step;
+    }
+}
+
+bool is_interactive (FILE *f) {
+#ifdef _WIN32
+    return _isatty(_fileno(f)) != 0;
+#else
+    return isatty(fileno(f)) != 0;
+#endif
+}
@@ -0,0 +1,579 @@
+#include "jit.h"
+
+#include "error.h"
+#include "tape.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <initializer_list>
+#include <vector>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define FFS_JIT_X86_64 1
+#include <sys/mman.h>
+#else
+#define FFS_JIT_X86_64 0
+#endif
+
+#if FFS_JIT_X86_64
+
+namespace
+{
+    constexpr std::uint8_t EOF_VALUE = 255;
+
+    // State shared between generated code and the C++ slow paths. The first
+    // five fields are read and written by the machine code at fixed offsets.
+    struct JitContext
+    {
+        std::uint8_t *base;
+        std::size_t ptr;
+        std::size_t last;         // highest valid index, tape size - 1
+        std::uint64_t checkpoint; // step count at which to consult the budget
+        std::uint64_t steps;      // spilled step counter, valid in helper_budget and on exit
+        Tape *tape;
+        const RunOptions *opts;
+        Budget *budget;
+        InputSource *in;
+        OutputBuffer *out;
+        FILE *file_err;
+        std::exception_ptr error; // set by a slow path that failed
+    };
+
+    static_assert(offsetof(JitContext, base) == 0, "generated code expects base at +0");
+    static_assert(offsetof(JitContext, ptr) == 8, "generated code expects ptr at +8");
+    static_assert(offsetof(JitContext, last) == 16, "generated code expects last at +16");
+    static_assert(offsetof(JitContext, checkpoint) == 24, "generated code expects checkpoint at +24");
+    static_assert(offsetof(JitContext, steps) == 32, "generated code expects steps at +32");
+
+    // Slow paths called from generated code. They return 0 to continue, or a
+    // non-zero exit status to stop execution.
+    using Helper = int (*)(JitContext *, int, int);
+
+    void sync(JitContext *ctx, std::size_t ptr)
+    {
+        ctx->base = ctx->tape->data();
+        ctx->last = ctx->tape->size() - 1;
+        ctx->ptr = ptr;
+    }
+
+    int helper_move(JitContext *ctx, int delta, int)
+    {
+        std::size_t ptr = ctx->ptr;
+        if (delta > 0)
+        {
+            ctx->tape->moveRight(ptr, delta);
+        }
+        else
+        {
+            ctx->tape->moveLeft(ptr, -delta);
+        }
+        sync(ctx, ptr);
+        return 0;
+    }
+
+    // ptr + offset under the edge rules, for cells generated code found
+    // off the tape
+    std::size_t cell_at(JitContext *ctx, int offset)
+    {
+        std::size_t ptr = ctx->ptr;
+        std::size_t target = offset == 0 ? ptr : ctx->tape->resolve(ptr, offset);
+        sync(ctx, ptr);
+        return target;
+    }
+
+    int helper_add(JitContext *ctx, int offset, int delta)
+    {
+        std::size_t at = cell_at(ctx, offset);
+        ctx->base[at] = static_cast<std::uint8_t>(ctx->base[at] + delta);
+        return 0;
+    }
+
+    int helper_zero_if_eof(JitContext *ctx, int offset, int)
+    {
+        std::size_t at = cell_at(ctx, offset);
+        if (ctx->base[at] == EOF_VALUE)
+        {
+            ctx->base[at] = 0;
+        }
+        return 0;
+    }
+
+    int helper_out(JitContext *ctx, int count, int offset)
+    {
+        ctx->out->put(ctx->base[cell_at(ctx, offset)], count);
+        return 0;
+    }
+
+    int helper_in(JitContext *ctx, int count, int offset)
+    {
+        std::size_t at = cell_at(ctx, offset);
+        if (ctx->in->interactive())
+        {
+            ctx->out->flush();
+        }
+        int ch = ctx->in->get(count);
+        ctx->base[at] = ch == EOF ? EOF_VALUE : static_cast<std::uint8_t>(ch);
+        return 0;
+    }
+
+    int helper_dbg(JitContext *ctx, int, int)
+    {
+        ctx->tape->dump(ctx->file_err, ctx->ptr, ctx->opts->dbgWidth);
+        return 0;
+    }
+
+    int helper_mul_add(JitContext *ctx, int offset, int factor)
+    {
+        std::uint8_t value = ctx->base[ctx->ptr];
+        std::size_t ptr = ctx->ptr;
+        std::size_t target = ctx->tape->resolve(ptr, offset);
+        sync(ctx, ptr);
+        ctx->base[target] = static_cast<std::uint8_t>(ctx->base[target] + value * factor);
+        return 0;
+    }
+
+    int helper_scan(JitContext *ctx, int stride, int)
+    {
+        std::size_t ptr = ctx->ptr;
+        ctx->tape->scan(ptr, stride);
+        sync(ctx, ptr);
+        return 0;
+    }
+
+    int helper_budget(JitContext *ctx, int, int)
+    {
+        ctx->budget->check(ctx->steps);
+        ctx->checkpoint = ctx->budget->next();
+        return 0;
+    }
+
+    // C++ exceptions cannot unwind through generated code, so every helper
+    // is entered through this wrapper, which parks the exception in the
+    // context and asks the machine code to stop
+    template <Helper Fn>
+    int guarded(JitContext *ctx, int a, int b)
+    {
+        try
+        {
+            return Fn(ctx, a, b);
+        }
+        catch (...)
+        {
+            ctx->error = std::current_exception();
+            return 1;
+        }
+    }
+
+    // Minimal x86-64 emitter. Register plan for generated code:
+    //   rbx = JitContext*, r12 = tape base, r13 = ptr, r14 = last index,
+    //   r15 = instructions executed so far (only when running under a budget)
+    class Assembler
+    {
+    public:
+        std::vector<std::uint8_t> bytes;
+
+        std::size_t pos() const
+        {
+            return bytes.size();
+        }
+
+        void emit(std::initializer_list<std::uint8_t> b)
+        {
+            bytes.insert(bytes.end(), b);
+        }
+
+        void imm32(std::int32_t v)
+        {
+            auto u = static_cast<std::uint32_t>(v);
+            emit({static_cast<std::uint8_t>(u), static_cast<std::uint8_t>(u >> 8),
+                  static_cast<std::uint8_t>(u >> 16), static_cast<std::uint8_t>(u >> 24)});
+        }
+
+        void imm64(std::uint64_t v)
+        {
+            for (int i = 0; i < 8; ++i)
+            {
+                bytes.push_back(static_cast<std::uint8_t>(v >> (8 * i)));
+            }
+        }
+
+        // Point the rel32 field at `at` to `target`
+        void patch(std::size_t at, std::size_t target)
+        {
+            auto rel = static_cast<std::int32_t>(static_cast<std::ptrdiff_t>(target) -
+                                                 static_cast<std::ptrdiff_t>(at + 4));
+            auto u = static_cast<std::uint32_t>(rel);
+            for (int i = 0; i < 4; ++i)
+            {
+                bytes[at + i] = static_cast<std::uint8_t>(u >> (8 * i));
+            }
+        }
+
+        // Conditional/unconditional jumps with a rel32 to fill in later;
+        // return the position of that field
+        std::size_t jcc(std::uint8_t cc)
+        {
+            emit({0x0F, cc});
+            std::size_t at = pos();
+            imm32(0);
+            return at;
+        }
+
+        std::size_t jmp()
+        {
+            emit({0xE9});
+            std::size_t at = pos();
+            imm32(0);
+            return at;
+        }
+
+        // cmp byte [r12 + r13], imm8
+        void cmpCell(std::uint8_t v)
+        {
+            emit({0x43, 0x80, 0x3C, 0x2C, v});
+        }
+
+        // lea rax, [r13 + disp32]; cmp rax, r14
+        void leaPtr(std::int32_t disp)
+        {
+            emit({0x49, 0x8D, 0x85});
+            imm32(disp);
+            emit({0x4C, 0x39, 0xF0});
+        }
+
+        // lea rcx, [r13 + disp32]; cmp rcx, r14. Follow with ja to the slow
+        // path, then address the cell as [r12 + rcx].
+        void leaCell(std::int32_t disp)
+        {
+            emit({0x49, 0x8D, 0x8D});
+            imm32(disp);
+            emit({0x4C, 0x39, 0xF1});
+        }
+
+        void reloadState()
+        {
+            emit({0x4C, 0x8B, 0x63, 0x00}); // mov r12, [rbx]
+            emit({0x4C, 0x8B, 0x6B, 0x08}); // mov r13, [rbx + 8]
+            emit({0x4C, 0x8B, 0x73, 0x10}); // mov r14, [rbx + 16]
+        }
+
+        // Spill ptr, call fn(ctx, a, b) and reload the state it may have
+        // changed. Returns the rel32 position of the bail-out jump taken
+        // when the helper asks to stop.
+        std::size_t call(Helper fn, std::int32_t a, std::int32_t b = 0)
+        {
+            emit({0x4C, 0x89, 0x6B, 0x08}); // mov [rbx + 8], r13
+            emit({0x48, 0x89, 0xDF});       // mov rdi, rbx
+            emit({0xBE});                   // mov esi, a
+            imm32(a);
+            emit({0xBA}); // mov edx, b
+            imm32(b);
+            emit({0x48, 0xB8}); // mov rax, fn
+            imm64(reinterpret_cast<std::uint64_t>(fn));
+            emit({0xFF, 0xD0}); // call rax
+            emit({0x85, 0xC0}); // test eax, eax
+            std::size_t bail = jcc(0x85);
+            reloadState();
+            return bail;
+        }
+    };
+
+    // An out-of-line slow path: entered from the jcc at `from`, calls the
+    // helper and resumes at `resume`
+    struct Stub
+    {
+        std::size_t from;
+        std::size_t resume;
+        Helper fn;
+        std::int32_t a;
+        std::int32_t b;
+    };
+
+    struct Fixup
+    {
+        std::size_t at;
+        std::size_t pc;
+    };
+
+    std::vector<std::uint8_t> generate(const Program &p, bool budgeted, std::size_t entry)
+    {
+        const std::size_t size = p.code.size();
+
+        Assembler a;
+        std::vector<std::size_t> pcOffset(size + 1);
+        std::vector<Fixup> jumps;
+        std::vector<Stub> stubs;
+        std::vector<std::size_t> bails;
+        std::vector<Stub> budgetChecks;
+
+        // Prologue: save callee-saved registers, keep rsp 16-byte aligned
+        a.emit({0x55});             // push rbp
+        a.emit({0x48, 0x89, 0xE5}); // mov rbp, rsp
+        a.emit({0x53});             // push rbx
+        a.emit({0x41, 0x54});       // push r12
+        a.emit({0x41, 0x55});       // push r13
+        a.emit({0x41, 0x56});       // push r14
+        a.emit({0x41, 0x57});       // push r15
+        a.emit({0x48, 0x83, 0xEC, 0x08}); // sub rsp, 8
+        a.emit({0x48, 0x89, 0xFB});       // mov rbx, rdi
+        a.reloadState();
+        if (budgeted)
+        {
+            a.emit({0x45, 0x31, 0xFF}); // xor r15d, r15d
+        }
+        // Programs with a compile-time prefix resume part-way through
+        if (entry != 0)
+        {
+            jumps.push_back({a.jmp(), entry});
+        }
+
+        // Straight-line runs start at the top, after every jump and at every
+        // jump target that is not already one of those
+        std::vector<bool> starts(size + 1, false);
+        starts[0] = true;
+        for (std::size_t pc = 0; pc < size; ++pc)
+        {
+            const Op op = p.code[pc].op;
+            if (op == Op::JZ || op == Op::JNZ || op == Op::GUARD)
+            {
+                starts[pc + 1] = true;
+            }
+            if (op == Op::GUARD)
+            {
+                starts[static_cast<std::size_t>(p.code[pc].arg)] = true;
+            }
+        }
+
+        for (std::size_t pc = 0; pc < size; ++pc)
+        {
+            pcOffset[pc] = a.pos();
+            const Instr &ins = p.code[pc];
+
+            // Straight-line runs end at a jump, so steps are counted once per
+            // run on entry instead of once per instruction. The budget is only
+            // compared against at the top of loop bodies, where every back-edge
+            // lands.
+            if (budgeted && starts[pc])
+            {
+                std::size_t len = 1;
+                while (!starts[pc + len])
+                {
+                    ++len;
+                }
+                a.emit({0x49, 0x81, 0xC7}); // add r15, len
+                a.imm32(static_cast<std::int32_t>(len));
+                if (pc > 0 && p.code[pc - 1].op == Op::JZ)
+                {
+                    a.emit({0x4C, 0x3B, 0x7B, 0x18}); // cmp r15, [rbx + 24]
+                    std::size_t from = a.jcc(0x87);   // ja: past the checkpoint
+                    budgetChecks.push_back({from, a.pos(), guarded<helper_budget>, 0, 0});
+                }
+            }
+
+            switch (ins.op)
+            {
+            case Op::INC_PTR:
+            case Op::DEC_PTR:
+            {
+                std::int32_t delta = ins.op == Op::INC_PTR ? ins.arg : -ins.arg;
+                a.leaPtr(delta);
+                std::size_t from = a.jcc(0x87); // ja: off the tape, take the slow path
+                a.emit({0x49, 0x89, 0xC5});     // mov r13, rax
+                stubs.push_back({from, a.pos(), guarded<helper_move>, delta, 0});
+                break;
+            }
+            case Op::INC:
+            case Op::DEC:
+            {
+                const bool add = ins.op == Op::INC;
+                if (ins.offset == 0)
+                {
+                    // add/sub byte [r12 + r13], imm8
+                    a.emit({0x43, 0x80, static_cast<std::uint8_t>(add ? 0x04 : 0x2C), 0x2C,
+                            static_cast<std::uint8_t>(ins.arg)});
+                    break;
+                }
+                a.leaCell(ins.offset);
+                std::size_t from = a.jcc(0x87); // ja: cell off the tape
+                // add/sub byte [r12 + rcx], imm8
+                a.emit({0x41, 0x80, static_cast<std::uint8_t>(add ? 0x04 : 0x2C), 0x0C,
+                        static_cast<std::uint8_t>(ins.arg)});
+                stubs.push_back({from, a.pos(), guarded<helper_add>, ins.offset, add ? ins.arg : -ins.arg});
+                break;
+            }
+            case Op::OUT:
+                bails.push_back(a.call(guarded<helper_out>, ins.arg, ins.offset));
+                break;
+            case Op::IN:
+                bails.push_back(a.call(guarded<helper_in>, ins.arg, ins.offset));
+                break;
+            case Op::JZ:
+                a.cmpCell(0);
+                jumps.push_back({a.jcc(0x84), static_cast<std::size_t>(ins.arg) + 1}); // je
+                break;
+            case Op::JNZ:
+                a.cmpCell(0);
+                jumps.push_back({a.jcc(0x85), static_cast<std::size_t>(ins.arg) + 1}); // jne
+                break;
+            case Op::ZERO_IF_EOF:
+            {
+                if (ins.offset == 0)
+                {
+                    a.cmpCell(EOF_VALUE);
+                    a.emit({0x75, 0x05});                   // jne +5
+                    a.emit({0x43, 0xC6, 0x04, 0x2C, 0x00}); // mov byte [r12 + r13], 0
+                    break;
+                }
+                a.leaCell(ins.offset);
+                std::size_t from = a.jcc(0x87);               // ja: cell off the tape
+                a.emit({0x41, 0x80, 0x3C, 0x0C, EOF_VALUE}); // cmp byte [r12 + rcx], 255
+                a.emit({0x75, 0x05});                         // jne +5
+                a.emit({0x41, 0xC6, 0x04, 0x0C, 0x00});       // mov byte [r12 + rcx], 0
+                stubs.push_back({from, a.pos(), guarded<helper_zero_if_eof>, ins.offset, 0});
+                break;
+            }
+            case Op::DBG:
+                bails.push_back(a.call(guarded<helper_dbg>, 0));
+                break;
+            case Op::CLEAR:
+                a.emit({0x43, 0xC6, 0x04, 0x2C, 0x00}); // mov byte [r12 + r13], 0
+                break;
+            case Op::SET:
+                // mov byte [r12 + r13], imm8
+                a.emit({0x43, 0xC6, 0x04, 0x2C, static_cast<std::uint8_t>(ins.arg)});
+                break;
+            case Op::MUL_ADD:
+            {
+                a.emit({0x43, 0x0F, 0xB6, 0x04, 0x2C}); // movzx eax, byte [r12 + r13]
+                a.emit({0x84, 0xC0});                   // test al, al
+                std::size_t skip = a.jcc(0x84);         // je skip
+                a.leaCell(ins.offset);
+                std::size_t from = a.jcc(0x87); // ja: target off the tape
+                a.emit({0x69, 0xC0});           // imul eax, eax, factor
+                a.imm32(ins.arg);
+                a.emit({0x41, 0x00, 0x04, 0x0C}); // add byte [r12 + rcx], al
+                a.patch(skip, a.pos());
+                stubs.push_back({from, a.pos(), guarded<helper_mul_add>, ins.offset, ins.arg});
+                break;
+            }
+            case Op::GUARD:
+                a.leaCell(ins.offset);
+                jumps.push_back({a.jcc(0x87), static_cast<std::size_t>(ins.arg)}); // ja: off the tape
+                break;
+            case Op::SCAN:
+            {
+                // One step is taken inline; anything longer is searched by
+                // the vector kernels behind helper_scan
+                a.cmpCell(0);
+                std::size_t done = a.jcc(0x84); // je done
+                a.leaPtr(ins.arg);
+                std::size_t edge = a.jcc(0x87); // ja: next step leaves the tape
+                a.emit({0x49, 0x89, 0xC5});     // mov r13, rax
+                a.cmpCell(0);
+                std::size_t far = a.jcc(0x85); // jne: still not there
+                a.patch(done, a.pos());
+                stubs.push_back({edge, a.pos(), guarded<helper_scan>, ins.arg, 0});
+                stubs.push_back({far, a.pos(), guarded<helper_scan>, ins.arg, 0});
+                break;
+            }
+            }
+        }
+
+        // Normal exit returns 0; helpers bail out here with their status in eax
+        pcOffset[size] = a.pos();
+        if (budgeted)
+        {
+            a.emit({0x4C, 0x89, 0x7B, 0x20}); // mov [rbx + 32], r15
+        }
+        a.emit({0x31, 0xC0}); // xor eax, eax
+        std::size_t exit = a.pos();
+        a.emit({0x48, 0x83, 0xC4, 0x08}); // add rsp, 8
+        a.emit({0x41, 0x5F});             // pop r15
+        a.emit({0x41, 0x5E});             // pop r14
+        a.emit({0x41, 0x5D});             // pop r13
+        a.emit({0x41, 0x5C});             // pop r12
+        a.emit({0x5B});                   // pop rbx
+        a.emit({0x5D});                   // pop rbp
+        a.emit({0xC3});                   // ret
+
+        // Cold slow paths live after the epilogue, out of the hot stream
+        for (const auto &stub : stubs)
+        {
+            a.patch(stub.from, a.pos());
+            bails.push_back(a.call(stub.fn, stub.a, stub.b));
+            a.patch(a.jmp(), stub.resume);
+        }
+        for (const auto &stub : budgetChecks)
+        {
+            a.patch(stub.from, a.pos());
+            a.emit({0x4C, 0x89, 0x7B, 0x20}); // mov [rbx + 32], r15
+            bails.push_back(a.call(stub.fn, stub.a, stub.b));
+            a.patch(a.jmp(), stub.resume);
+        }
+
+        for (const auto &jump : jumps)
+        {
+            a.patch(jump.at, pcOffset[jump.pc]);
+        }
+        for (std::size_t at : bails)
+        {
+            a.patch(at, exit);
+        }
+        return std::move(a.bytes);
+    }
+} // namespace
+
+bool jit_supported()
+{
+    return true;
+}
+
+std::optional<int> run_jit(const Program &p, const RunOptions &opts, Tape &tape, Budget &budget, InputSource &in, OutputBuffer &out, FILE *file_err,
+                           std::size_t entry, std::size_t ptr)
+{
+    std::vector<std::uint8_t> code = generate(p, budget.enabled(), entry);
+
+    // Write the code while the mapping is writable, then flip it to
+    // read+execute so it is never both at once
+    void *mem = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        return std::nullopt;
+    }
+    std::copy(code.begin(), code.end(), static_cast<std::uint8_t *>(mem));
+    if (mprotect(mem, code.size(), PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(mem, code.size());
+        return std::nullopt;
+    }
+
+    JitContext ctx{tape.data(), ptr, tape.size() - 1, budget.next(), 0, &tape, &opts, &budget, &in, &out, file_err, nullptr};
+
+    auto native = reinterpret_cast<int (*)(JitContext *)>(mem);
+    int status = native(&ctx);
+
+    munmap(mem, code.size());
+    if (ctx.error)
+    {
+        std::rethrow_exception(ctx.error);
+    }
+    budget.finish(ctx.steps);
+    return status;
+}
+
+#else
+
+bool jit_supported()
+{
+    return false;
+}
+
+std::optional<int> run_jit(const Program &, const RunOptions &, Tape &, Budget &, InputSource &, OutputBuffer &, FILE *,
+                           std::size_t, std::size_t)
+{
+    return std::nullopt;
+}
+
+#endif
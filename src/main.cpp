@@ -1,28 +1,54 @@
 #include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <utility>
 
-#include "compiler.h"
+#include "batch.h"
+#include "bytecode.h"
+#include "cgen.h"
 #include "error.h"
-#include "util.h"
+#include "ffs.h"
+#include "trace.h"
 #include "vm.h"
 #include "version.h"
 
+namespace {
+    constexpr std::size_t MAX_CELLS = std::size_t(1) << (sizeof(std::size_t) >= 8 ? 32 : 28);
+}
+
 int main (int argc, char **argv) {
     std::ios::sync_with_stdio(false);
     std::cin.tie(nullptr);
 
+    if (argc > 1 && std::string(argv[1]) == "trace-dump") {
+        return trace_dump(argc - 2, argv + 2);
+    }
+
     std::string file;
-    int         cells   = 30000;
-    int         dbg     = 8;
-    bool        elastic = false;
-    bool        strict  = false;
-    bool        trace   = false;
+    std::string emitPath;
+    std::string cPath;
+    std::string exePath;
+    std::string batchFile;
+    unsigned    jobs = 0;
+    bool        cellBitsGiven = false;
+    std::string cacheDir = std::getenv("FFS_CACHE_DIR") ? std::getenv("FFS_CACHE_DIR") : "";
+    RunOptions  opts;
 
     for (int i = 1; i < argc; ++i) {
-        std::string a       = argv[i];
-        auto        needVal = [&](const std::string &name) {
+        std::string                a = argv[i];
+        std::optional<std::string> inlineVal; // --name=value form
+        if (a.rfind("--", 0) == 0 && a.find('=') != std::string::npos) {
+            inlineVal = a.substr(a.find('=') + 1);
+            a         = a.substr(0, a.find('='));
+        }
+        auto needVal = [&](const std::string &name) {
+            if (inlineVal) {
+                return *inlineVal;
+            }
             if (i + 1 >= argc) {
                 ffs::ErrorReporter::argumentError(ffs::ErrorCode::MISSING_ARGUMENT_VALUE,
                                                   "Missing value for " + name,
@@ -30,22 +56,34 @@ int main (int argc, char **argv) {
             }
             return std::string(argv[++i]);
         };
-        if (a == "-f" || a == "--file") {
-            file = needVal(a);
-        } else if (a == "--cells") {
+        // Tape sizes: reserved address space, not allocated memory, so the
+        // cap is only there to keep the reservation sane
+        auto needCells = [&](const std::string &name, const std::string &example) {
+            std::string val = needVal(name);
+            std::size_t cells = 0;
             try {
-                int val = std::stoi(needVal(a));
-                if (val < 1 || val > 1000000) {
-                    ffs::ErrorReporter::argumentError(ffs::ErrorCode::OUT_OF_RANGE,
-                                                      "--cells must be between 1 and 1,000,000",
-                                                      "Try a value like --cells 30000");
+                if (val.empty() || val[0] == '-') {
+                    throw std::invalid_argument("negative");
                 }
-                cells = val;
-            } catch (const std::exception &e) {
+                cells = static_cast<std::size_t>(std::stoull(val));
+            } catch (const std::exception &) {
                 ffs::ErrorReporter::argumentError(ffs::ErrorCode::INVALID_ARGUMENT_VALUE,
-                                                  "Invalid value for --cells: " + std::string(e.what()),
-                                                  "Use a numeric value, e.g., --cells 30000");
+                                                  "Invalid value for " + name + ": " + val,
+                                                  "Use a numeric value, e.g., " + example);
             }
+            if (cells < 1 || cells > MAX_CELLS) {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::OUT_OF_RANGE,
+                                                  name + " must be between 1 and " + std::to_string(MAX_CELLS),
+                                                  "Try a value like " + example);
+            }
+            return cells;
+        };
+        if (a == "-f" || a == "--file") {
+            file = needVal(a);
+        } else if (a == "--cells") {
+            opts.cells = needCells(a, "--cells 30000");
+        } else if (a == "--max-cells") {
+            opts.maxCells = needCells(a, "--max-cells 67108864");
         } else if (a == "--dbg") {
             try {
                 int val = std::stoi(needVal(a));
@@ -54,32 +92,198 @@ int main (int argc, char **argv) {
                                                       "--dbg must be between 1 and 1,000",
                                                       "Try a value like --dbg 8");
                 }
-                dbg = val;
+                opts.dbgWidth = val;
             } catch (const std::exception &e) {
                 ffs::ErrorReporter::argumentError(ffs::ErrorCode::INVALID_ARGUMENT_VALUE,
                                                   "Invalid value for --dbg: " + std::string(e.what()),
                                                   "Use a numeric value, e.g., --dbg 8");
             }
+        } else if (a == "--max-steps") {
+            std::string val = needVal(a);
+            try {
+                if (val.empty() || val[0] == '-') {
+                    throw std::invalid_argument("negative");
+                }
+                opts.maxSteps = std::stoull(val);
+            } catch (const std::exception &) {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::INVALID_ARGUMENT_VALUE,
+                                                  "Invalid value for --max-steps: " + val,
+                                                  "Use a non-negative count, e.g., --max-steps 10000000 (0 = unlimited)");
+            }
+        } else if (a == "--timeout") {
+            std::string val = needVal(a);
+            try {
+                double secs = std::stod(val);
+                if (!(secs >= 0)) {
+                    ffs::ErrorReporter::argumentError(ffs::ErrorCode::OUT_OF_RANGE,
+                                                      "--timeout must not be negative",
+                                                      "Try a value like --timeout 5 (0 = unlimited)");
+                }
+                opts.timeout = secs;
+            } catch (const std::exception &) {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::INVALID_ARGUMENT_VALUE,
+                                                  "Invalid value for --timeout: " + val,
+                                                  "Use a number of seconds, e.g., --timeout 2.5 (0 = unlimited)");
+            }
+        } else if (a == "--checkpoint-every") {
+            // A count of instructions, or seconds with an 's' suffix
+            std::string val = needVal(a);
+            try {
+                if (val.empty() || val[0] == '-') {
+                    throw std::invalid_argument("negative");
+                }
+                std::size_t used = 0;
+                if (val.back() == 's') {
+                    opts.checkpointSeconds = std::stod(val.substr(0, val.size() - 1), &used);
+                    if (used != val.size() - 1 || !(opts.checkpointSeconds > 0)) {
+                        throw std::invalid_argument("seconds");
+                    }
+                } else {
+                    opts.checkpointSteps = std::stoull(val, &used);
+                    if (used != val.size() || opts.checkpointSteps == 0) {
+                        throw std::invalid_argument("steps");
+                    }
+                }
+            } catch (const std::exception &) {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::INVALID_ARGUMENT_VALUE,
+                                                  "Invalid value for --checkpoint-every: " + val,
+                                                  "Use a number of instructions or of seconds, e.g., --checkpoint-every 1000000000 or --checkpoint-every 60s");
+            }
+        } else if (a == "--checkpoint") {
+            opts.checkpointOut = needVal(a);
+        } else if (a == "--resume") {
+            opts.resumeFrom = needVal(a);
+        } else if (a == "--cell-bits") {
+            std::string val = needVal(a);
+            if (val != "8" && val != "16" && val != "32") {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::INVALID_ARGUMENT_VALUE,
+                                                  "Invalid value for --cell-bits: " + val,
+                                                  "Use --cell-bits 8, --cell-bits 16 or --cell-bits 32");
+            }
+            opts.cellBits = std::stoi(val);
+            cellBitsGiven = true;
         } else if (a == "--elastic") {
-            elastic = true;
+            opts.elastic = true;
         } else if (a == "--strict") {
-            strict = true;
+            opts.strict = true;
         } else if (a == "--trace") {
-            trace = true;
+            opts.trace = true;
+            if (inlineVal) {
+                opts.traceOut = *inlineVal;
+            }
+        } else if (a == "--trace-size") {
+            std::string val = needVal(a);
+            try {
+                if (val.empty() || val[0] == '-') {
+                    throw std::invalid_argument("negative");
+                }
+                opts.traceSize = static_cast<std::size_t>(std::stoull(val));
+            } catch (const std::exception &) {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::INVALID_ARGUMENT_VALUE,
+                                                  "Invalid value for --trace-size: " + val,
+                                                  "Use a record count, e.g., --trace-size 1048576");
+            }
+            if (opts.traceSize < 1 || opts.traceSize > (std::size_t(1) << 28)) {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::OUT_OF_RANGE,
+                                                  "--trace-size must be between 1 and 268435456",
+                                                  "Try a value like --trace-size 1048576");
+            }
+        } else if (a == "--profile") {
+            opts.profile = true;
+            if (inlineVal) {
+                opts.profileOut = *inlineVal;
+            }
+        } else if (a == "--engine") {
+            std::string val = needVal(a);
+            if (val == "switch") {
+                opts.engine = Engine::SWITCH;
+            } else if (val == "threaded") {
+                opts.engine = Engine::THREADED;
+            } else if (val == "jit") {
+                opts.engine = Engine::JIT;
+            } else {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::INVALID_ARGUMENT_VALUE,
+                                                  "Invalid value for --engine: " + val,
+                                                  "Use --engine switch, --engine threaded or --engine jit");
+            }
+        } else if (a == "--jit") {
+            opts.engine = Engine::JIT;
+        } else if (a == "--flush") {
+            std::string val = needVal(a);
+            if (val == "line") {
+                opts.flush = FlushMode::LINE;
+            } else if (val == "block") {
+                opts.flush = FlushMode::BLOCK;
+            } else if (val == "none") {
+                opts.flush = FlushMode::NONE;
+            } else {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::INVALID_ARGUMENT_VALUE,
+                                                  "Invalid value for --flush: " + val,
+                                                  "Use --flush=line, --flush=block or --flush=none");
+            }
+        } else if (a == "--emit-bytecode") {
+            emitPath = needVal(a);
+        } else if (a == "--emit-c") {
+            cPath = needVal(a);
+        } else if (a == "--build") {
+            exePath = needVal(a);
+        } else if (a == "--cache-dir") {
+            cacheDir = needVal(a);
+        } else if (a == "--batch") {
+            batchFile = needVal(a);
+        } else if (a == "--jobs") {
+            try {
+                int val = std::stoi(needVal(a));
+                if (val < 0 || val > 1024) {
+                    ffs::ErrorReporter::argumentError(ffs::ErrorCode::OUT_OF_RANGE,
+                                                      "--jobs must be between 0 and 1,024",
+                                                      "Use --jobs 0 for one worker per core");
+                }
+                jobs = static_cast<unsigned>(val);
+            } catch (const std::exception &e) {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::INVALID_ARGUMENT_VALUE,
+                                                  "Invalid value for --jobs: " + std::string(e.what()),
+                                                  "Use a numeric value, e.g., --jobs 8");
+            }
         } else if (a == "--version" || a == "-v") {
             std::cout << "FFS version " << ffs_version::VERSION_STRING << std::endl;
             return 0;
         } else if (a == "--help" || a == "-h") {
             std::cout << "FFS - A Brainfuck-like language interpreter\n"
                     << "Version: " << ffs_version::VERSION_STRING << "\n\n"
-                    << "Usage: " << argv[0] << " [OPTIONS]\n\n"
+                    << "Usage: " << argv[0] << " [OPTIONS]\n"
+                    << "       " << argv[0] << " trace-dump <file> [--pc N|A-B] [--op NAME] [--first N] [--last N]\n\n"
                     << "Options:\n"
                     << "  -f, --file <file>    Input file (default: stdin)\n"
                     << "      --cells <n>      Number of memory cells (default: 30000)\n"
                     << "      --dbg <n>        Debug level (default: 8)\n"
-                    << "      --elastic        Enable elastic memory\n"
+                    << "      --max-steps <n>  Stop after n instructions (default: 0 = unlimited)\n"
+                    << "      --timeout <secs> Stop after secs of wall-clock time (default: 0 = unlimited)\n"
+                    << "      --checkpoint-every <n|secs>s\n"
+                    << "                       Snapshot the run every n instructions or secs seconds\n"
+                    << "      --checkpoint <file> Where snapshots go (default: ffs.ckpt)\n"
+                    << "      --resume <file>  Continue a run from a snapshot\n"
+                    << "      --elastic        Enable elastic memory (grows in both directions)\n"
+                    << "      --max-cells <n>  Growth limit for elastic memory (default: 16777216)\n"
+                    << "      --cell-bits <n>  Cell width: 8, 16 or 32 bits (default: 8)\n"
                     << "      --strict         Enable strict mode\n"
-                    << "      --trace          Enable trace mode\n"
+                    << "      --trace[=file]   Record the last --trace-size steps to file (default: ffs.trace);\n"
+                    << "                       read it back with trace-dump\n"
+                    << "      --trace-size <n> Steps kept by --trace (default: 1048576)\n"
+                    << "      --profile[=file] Report hot loops on exit and write folded stacks to file\n"
+                    << "                       (default: ffs-profile.folded)\n"
+                    << "      --engine <name>  Dispatch engine: threaded (default), switch or jit\n"
+                    << "      --jit            Compile to native code (x86-64; same as --engine jit)\n"
+                    << "      --flush <mode>   Output flushing: line, block or none\n"
+                    << "                       (default: line on a terminal, block otherwise)\n"
+                    << "      --emit-bytecode <out.ffsc>\n"
+                    << "                       Compile to bytecode instead of running; -f accepts .ffsc files\n"
+                    << "      --emit-c <out.c> Translate to a standalone C program instead of running; the\n"
+                    << "                       tape options are built in, step and time limits are not\n"
+                    << "      --build <exe>    Compile to a native executable with the system C compiler ($CC)\n"
+                    << "      --cache-dir <dir> Cache compiled bytecode in dir (default: $FFS_CACHE_DIR)\n"
+                    << "      --batch <file>   Run the jobs listed in file, one 'program input output' per line\n"
+                    << "      --jobs <n>       Worker threads for --batch (default: 0 = one per core)\n"
                     << "  -v, --version        Show version information\n"
                     << "  -h, --help           Show this help message\n";
             return 0;
@@ -90,27 +294,93 @@ int main (int argc, char **argv) {
         }
     }
 
-    std::string src;
-    if (file.empty()) {
-        src = read_all(std::cin);
-    } else {
-        std::ifstream fin(file, std::ios::binary);
-        if (!fin) {
-            ffs::ErrorReporter::ioError(ffs::ErrorCode::FILE_NOT_FOUND,
-                                        "Could not open file: " + file,
-                                        file,
-                                        "Check that the file exists and you have permission to read it");
+    if (!batchFile.empty()) {
+        // Every job would share the one snapshot file
+        if (opts.checkpointSteps != 0 || opts.checkpointSeconds > 0 || !opts.resumeFrom.empty()) {
+            ffs::ErrorReporter::argumentError(ffs::ErrorCode::INVALID_ARGUMENT_VALUE,
+                                              "--checkpoint-every and --resume cannot be used with --batch",
+                                              "Checkpoint long jobs by running them on their own");
         }
-        try {
-            src = read_all(fin);
-        } catch (const std::exception &e) {
+        return run_batch(batchFile, opts, jobs, cacheDir);
+    }
+
+    Program       prog;
+    std::uint64_t sourceKey = 0;
+    if (!file.empty() && is_bytecode_file(file)) {
+        auto loaded = load_bytecode(file);
+        if (!loaded) {
             ffs::ErrorReporter::ioError(ffs::ErrorCode::FILE_READ_ERROR,
-                                        "Error reading file: " + std::string(e.what()),
+                                        "Bytecode file is damaged or was built by a different FFS version",
                                         file,
-                                        "Ensure the file is not corrupted and you have read permissions");
+                                        "Rebuild it from source with --emit-bytecode");
+        }
+        prog = std::move(*loaded);
+        // Bytecode knows the width it was built for
+        if (!cellBitsGiven) {
+            opts.cellBits = prog.cellBits;
+        }
+    } else {
+        // Compiled straight from the stream, so a huge source is never
+        // held in memory whole
+        std::ifstream fin;
+        if (!file.empty()) {
+            fin.open(file, std::ios::binary);
+            if (!fin) {
+                ffs::ErrorReporter::ioError(ffs::ErrorCode::FILE_NOT_FOUND,
+                                            "Could not open file: " + file,
+                                            file,
+                                            "Check that the file exists and you have permission to read it");
+            }
+        }
+        try {
+            prog = compile_cached(file.empty() ? std::cin : fin, file, opts.dbgWidth, opts.cellBits, cacheDir,
+                                  &sourceKey);
+        } catch (const ffs::Error &e) {
+            ffs::ErrorReporter::fatal(e.info());
+        }
+    }
+
+    if (!emitPath.empty()) {
+        if (!save_bytecode(prog, sourceKey, emitPath)) {
+            ffs::ErrorReporter::ioError(ffs::ErrorCode::FILE_WRITE_ERROR,
+                                        "Could not write bytecode file: " + emitPath,
+                                        emitPath,
+                                        "Check that the directory exists and is writable");
         }
+        return 0;
     }
 
-    Program prog = compile_src(src, dbg, file);
-    return run(prog, cells, elastic, strict, dbg, trace, stdin, stdout, stderr);
+    if (!cPath.empty() || !exePath.empty()) {
+        // --build on its own goes through a C file next to the executable
+        std::string   out = cPath.empty() ? exePath + ".c" : cPath;
+        std::ofstream fout(out, std::ios::binary);
+        fout << emit_c(prog, opts, file);
+        fout.close();
+        if (!fout) {
+            ffs::ErrorReporter::ioError(ffs::ErrorCode::FILE_WRITE_ERROR,
+                                        "Could not write C file: " + out,
+                                        out,
+                                        "Check that the directory exists and is writable");
+        }
+        if (!exePath.empty()) {
+            int status = build_native(out, exePath);
+            if (cPath.empty()) {
+                std::remove(out.c_str());
+            }
+            if (status != 0) {
+                ffs::ErrorReporter::ioError(ffs::ErrorCode::FILE_WRITE_ERROR,
+                                            "C compiler failed to build " + exePath,
+                                            exePath,
+                                            "Check that a C compiler is installed (set CC to choose one)");
+            }
+        }
+        return 0;
+    }
+
+    ffs::Vm     vm(opts);
+    ffs::Result result = vm.run(prog);
+    if (!result.ok()) {
+        ffs::ErrorReporter::fatal(*result.error);
+    }
+    return result.status;
 }
@@ -0,0 +1,172 @@
+#include "prefix.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace
+{
+    // Bounds on the work done at compile time. A prefix cut short by one
+    // still keeps everything it did up to there.
+    constexpr std::uint64_t STEP_BUDGET = 1u << 22;
+    constexpr std::size_t TAPE_CELLS = 1u << 16; // cells right of home the walk may use
+    constexpr std::size_t OUTPUT_LIMIT = 1u << 20;
+
+    // Mirrors the engines in vm.cpp, but stops before any instruction it
+    // cannot finish the same way on every run: input, '!' output, or a move
+    // off its own tape. ',' stores all ones on EOF, as there.
+    template <typename Cell>
+    void evaluate(Program &p)
+    {
+        static constexpr Cell EOF_VALUE = static_cast<Cell>(~Cell(0));
+        constexpr std::size_t OFF = TAPE_CELLS;
+
+        const std::vector<Instr> &code = p.code;
+        std::vector<Cell> mem(TAPE_CELLS);
+        std::string output;
+        std::size_t ptr = 0;
+        std::size_t span = 1;
+        std::size_t pc = 0;
+
+        // Index of ptr + delta, or OFF when that is not on the walk's tape
+        auto at = [&](std::size_t from, long long delta)
+        {
+            long long to = static_cast<long long>(from) + delta;
+            return to < 0 || to >= static_cast<long long>(TAPE_CELLS) ? OFF : static_cast<std::size_t>(to);
+        };
+
+        for (std::uint64_t steps = 0; pc < code.size() && steps < STEP_BUDGET; ++steps)
+        {
+            const Instr &ins = code[pc];
+            std::size_t next = pc + 1;
+            std::size_t target = ptr;
+            switch (ins.op)
+            {
+            case Op::INC_PTR:
+            case Op::DEC_PTR:
+                target = at(ptr, ins.op == Op::INC_PTR ? ins.arg : -static_cast<long long>(ins.arg));
+                if (target != OFF)
+                {
+                    ptr = target;
+                }
+                break;
+            case Op::INC:
+            case Op::DEC:
+                target = at(ptr, ins.offset);
+                if (target != OFF)
+                {
+                    Cell delta = static_cast<Cell>(ins.arg);
+                    mem[target] = static_cast<Cell>(ins.op == Op::INC ? mem[target] + delta : mem[target] - delta);
+                }
+                break;
+            case Op::OUT:
+                target = at(ptr, ins.offset);
+                if (output.size() + static_cast<std::size_t>(ins.arg) > OUTPUT_LIMIT)
+                {
+                    target = OFF;
+                }
+                if (target != OFF)
+                {
+                    output.append(static_cast<std::size_t>(ins.arg), static_cast<char>(static_cast<std::uint8_t>(mem[target])));
+                }
+                break;
+            case Op::IN:
+            case Op::DBG:
+                target = OFF;
+                break;
+            case Op::JZ:
+                if (mem[ptr] == 0)
+                {
+                    next = static_cast<std::size_t>(ins.arg) + 1;
+                }
+                break;
+            case Op::JNZ:
+                if (mem[ptr] != 0)
+                {
+                    next = static_cast<std::size_t>(ins.arg) + 1;
+                }
+                break;
+            case Op::ZERO_IF_EOF:
+                target = at(ptr, ins.offset);
+                if (target != OFF && mem[target] == EOF_VALUE)
+                {
+                    mem[target] = 0;
+                }
+                break;
+            case Op::CLEAR:
+                mem[ptr] = 0;
+                break;
+            case Op::SET:
+                mem[ptr] = static_cast<Cell>(ins.arg);
+                break;
+            case Op::GUARD:
+                // Its cell counts towards span, so a run that starts from
+                // the prefix passes it too; off the walk's tape it stops
+                target = at(ptr, ins.offset);
+                break;
+            case Op::MUL_ADD:
+                if (mem[ptr] != 0)
+                {
+                    target = at(ptr, ins.offset);
+                    if (target != OFF)
+                    {
+                        std::uint32_t factor = mem[ptr];
+                        mem[target] = static_cast<Cell>(mem[target] + factor * static_cast<std::uint32_t>(ins.arg));
+                    }
+                }
+                break;
+            case Op::SCAN:
+                while (target != OFF && mem[target] != 0)
+                {
+                    target = at(target, ins.arg);
+                }
+                if (target != OFF)
+                {
+                    ptr = target;
+                }
+                break;
+            }
+            if (target == OFF)
+            {
+                break;
+            }
+            span = std::max(span, target + 1);
+            pc = next;
+        }
+
+        if (pc == 0)
+        {
+            return;
+        }
+        std::size_t used = span;
+        while (used > 0 && mem[used - 1] == 0)
+        {
+            --used;
+        }
+        p.prefix.entry = static_cast<std::uint32_t>(pc);
+        p.prefix.ptr = static_cast<std::uint32_t>(ptr);
+        p.prefix.span = static_cast<std::uint32_t>(span);
+        p.prefix.cells.assign(mem.begin(), mem.begin() + static_cast<std::ptrdiff_t>(used));
+        p.prefix.output = std::move(output);
+    }
+} // namespace
+
+void evaluate_prefix(Program &p)
+{
+    p.prefix = Prefix{};
+    switch (p.cellBits)
+    {
+    case 16:
+        evaluate<std::uint16_t>(p);
+        break;
+    case 32:
+        evaluate<std::uint32_t>(p);
+        break;
+    default:
+        evaluate<std::uint8_t>(p);
+        break;
+    }
+}
@@ -0,0 +1,128 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+namespace
+{
+    // Hottest loops listed in the report
+    constexpr std::size_t REPORT_LOOPS = 10;
+
+    struct Loop
+    {
+        std::size_t open;
+        std::size_t close;
+        long parent;                 // index into the loop list, -1 at top level
+        std::uint64_t self = 0;      // steps spent directly in this loop's body
+        std::uint64_t inclusive = 0; // self plus nested loops
+    };
+
+    std::string loop_name(const Program &p, const Loop &loop)
+    {
+        auto label = p.debug.labels.find(static_cast<std::int32_t>(loop.open));
+        std::string name = label != p.debug.labels.end() ? label->second : "loop";
+        auto pos = p.debug.positions.find(static_cast<std::int32_t>(loop.open));
+        if (pos != p.debug.positions.end() && pos->second.line > 0)
+        {
+            name.append("@").append(std::to_string(pos->second.line));
+            name.append(":").append(std::to_string(pos->second.column));
+        }
+        else
+        {
+            name.append("@pc").append(std::to_string(loop.open));
+        }
+        return name;
+    }
+}
+
+void write_profile(const Program &p, const std::vector<std::uint64_t> &hits, FILE *report,
+                   const std::string &foldedPath)
+{
+    // Loops nest as contiguous pc ranges, so one walk with a stack assigns
+    // every pc to its innermost enclosing loop
+    std::vector<Loop> loops;
+    std::vector<long> open;
+    std::uint64_t topLevel = 0;
+    std::uint64_t total = 0;
+    for (std::size_t pc = 0; pc < p.code.size(); ++pc)
+    {
+        if (p.code[pc].op == Op::JZ)
+        {
+            loops.push_back({pc, static_cast<std::size_t>(p.code[pc].arg), open.empty() ? -1 : open.back()});
+            open.push_back(static_cast<long>(loops.size() - 1));
+        }
+        total += hits[pc];
+        (open.empty() ? topLevel : loops[open.back()].self) += hits[pc];
+        if (p.code[pc].op == Op::JNZ && !open.empty())
+        {
+            open.pop_back();
+        }
+    }
+    // Children come after their parents, so one backwards pass sums them up
+    for (std::size_t i = loops.size(); i-- > 0;)
+    {
+        loops[i].inclusive += loops[i].self;
+        if (loops[i].parent >= 0)
+        {
+            loops[loops[i].parent].inclusive += loops[i].inclusive;
+        }
+    }
+
+    std::fprintf(report, "profile: %llu instructions executed\n", static_cast<unsigned long long>(total));
+    std::vector<std::size_t> order(loops.size());
+    for (std::size_t i = 0; i < order.size(); ++i)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(),
+              [&](std::size_t a, std::size_t b) { return loops[a].inclusive > loops[b].inclusive; });
+    if (!order.empty())
+    {
+        std::fprintf(report, "%14s %6s %12s %14s  %s\n", "steps", "%", "entries", "iterations", "loop");
+    }
+    for (std::size_t k = 0; k < order.size() && k < REPORT_LOOPS; ++k)
+    {
+        const Loop &loop = loops[order[k]];
+        if (loop.inclusive == 0)
+        {
+            break;
+        }
+        std::fprintf(report, "%14llu %5.1f%% %12llu %14llu  %s\n",
+                     static_cast<unsigned long long>(loop.inclusive),
+                     total > 0 ? 100.0 * static_cast<double>(loop.inclusive) / static_cast<double>(total) : 0.0,
+                     static_cast<unsigned long long>(hits[loop.open]),
+                     static_cast<unsigned long long>(hits[loop.close]),
+                     loop_name(p, loop).c_str());
+    }
+
+    // Sorted by stack, so the file is stable from run to run
+    std::map<std::string, std::uint64_t> folded;
+    std::vector<std::string> stacks(loops.size());
+    for (std::size_t i = 0; i < loops.size(); ++i)
+    {
+        stacks[i] = (loops[i].parent >= 0 ? stacks[loops[i].parent] : std::string("main")) + ";" +
+                    loop_name(p, loops[i]);
+        if (loops[i].self > 0)
+        {
+            folded[stacks[i]] += loops[i].self;
+        }
+    }
+    if (topLevel > 0)
+    {
+        folded["main"] += topLevel;
+    }
+
+    FILE *out = std::fopen(foldedPath.c_str(), "w");
+    if (out == nullptr)
+    {
+        std::fprintf(report, "profile: could not write %s\n", foldedPath.c_str());
+        return;
+    }
+    for (const auto &[stack, steps] : folded)
+    {
+        std::fprintf(out, "%s %llu\n", stack.c_str(), static_cast<unsigned long long>(steps));
+    }
+    std::fclose(out);
+    std::fprintf(report, "profile: folded stacks written to %s\n", foldedPath.c_str());
+}
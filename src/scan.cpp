@@ -0,0 +1,221 @@
+#include "scan.h"
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define FFS_SCAN_X86 1
+#include <immintrin.h>
+#else
+#define FFS_SCAN_X86 0
+#endif
+
+namespace
+{
+    struct Kernels
+    {
+        std::size_t (*right)(const std::uint8_t *, std::size_t, std::size_t, std::size_t);
+        std::size_t (*left)(const std::uint8_t *, std::size_t, std::size_t);
+        unsigned width; // cells compared at once; wider strides walk instead
+    };
+
+    template <typename Cell>
+    std::size_t walk_right(const Cell *cells, std::size_t from, std::size_t end, std::size_t stride)
+    {
+        for (std::size_t i = from; i < end; i += stride)
+        {
+            if (cells[i] == 0)
+            {
+                return i;
+            }
+            if (end - i <= stride)
+            {
+                break;
+            }
+        }
+        return NO_ZERO;
+    }
+
+    template <typename Cell>
+    std::size_t walk_left(const Cell *cells, std::size_t from, std::size_t stride)
+    {
+        for (std::size_t i = from;; i -= stride)
+        {
+            if (cells[i] == 0)
+            {
+                return i;
+            }
+            if (i < stride)
+            {
+                return NO_ZERO;
+            }
+        }
+    }
+
+#if FFS_SCAN_X86
+    // Which lanes of a block of `width` cells the walk lands on. A block's
+    // zero mask is ANDed with this, so a zero between two stops never
+    // counts. `skip` is how far the first stop lies into the block: from the
+    // lowest lane going right, from the highest going left.
+    class Lanes
+    {
+    public:
+        Lanes(std::size_t stride, unsigned width, bool left)
+            : stride(stride), left(left), advance(static_cast<std::size_t>(width) % stride)
+        {
+            for (std::size_t lane = 0; lane < width; lane += stride)
+            {
+                pattern |= 1u << (left ? width - 1 - lane : lane);
+            }
+        }
+
+        std::uint32_t take(std::uint32_t zeros)
+        {
+            std::uint32_t hits = zeros & (left ? pattern >> skip : pattern << skip);
+            skip = (skip + stride - advance) % stride;
+            return hits;
+        }
+
+        std::size_t pending() const
+        {
+            return skip;
+        }
+
+    private:
+        std::size_t stride;
+        bool left;
+        std::size_t advance;
+        std::uint32_t pattern = 0;
+        std::size_t skip = 0;
+    };
+
+    std::size_t sse2_right(const std::uint8_t *cells, std::size_t from, std::size_t end, std::size_t stride)
+    {
+        Lanes lanes(stride, 16, false);
+        const __m128i zero = _mm_setzero_si128();
+        std::size_t i = from;
+        for (; end - i >= 16; i += 16)
+        {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cells + i));
+            std::uint32_t hits = lanes.take(static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, zero))));
+            if (hits != 0)
+            {
+                return i + static_cast<std::size_t>(__builtin_ctz(hits));
+            }
+        }
+        return end - i > lanes.pending() ? walk_right(cells, i + lanes.pending(), end, stride) : NO_ZERO;
+    }
+
+    std::size_t sse2_left(const std::uint8_t *cells, std::size_t from, std::size_t stride)
+    {
+        Lanes lanes(stride, 16, true);
+        const __m128i zero = _mm_setzero_si128();
+        std::size_t count = from + 1; // cells at or below the next block's top
+        for (; count >= 16; count -= 16)
+        {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cells + count - 16));
+            std::uint32_t hits = lanes.take(static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, zero))));
+            if (hits != 0)
+            {
+                return count - 16 + static_cast<std::size_t>(31 - __builtin_clz(hits));
+            }
+        }
+        return count > lanes.pending() ? walk_left(cells, count - 1 - lanes.pending(), stride) : NO_ZERO;
+    }
+
+    __attribute__((target("avx2"))) std::size_t avx2_right(const std::uint8_t *cells, std::size_t from,
+                                                           std::size_t end, std::size_t stride)
+    {
+        Lanes lanes(stride, 32, false);
+        const __m256i zero = _mm256_setzero_si256();
+        std::size_t i = from;
+        for (; end - i >= 32; i += 32)
+        {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(cells + i));
+            std::uint32_t hits =
+                lanes.take(static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero))));
+            if (hits != 0)
+            {
+                return i + static_cast<std::size_t>(__builtin_ctz(hits));
+            }
+        }
+        return end - i > lanes.pending() ? walk_right(cells, i + lanes.pending(), end, stride) : NO_ZERO;
+    }
+
+    __attribute__((target("avx2"))) std::size_t avx2_left(const std::uint8_t *cells, std::size_t from,
+                                                          std::size_t stride)
+    {
+        Lanes lanes(stride, 32, true);
+        const __m256i zero = _mm256_setzero_si256();
+        std::size_t count = from + 1;
+        for (; count >= 32; count -= 32)
+        {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(cells + count - 32));
+            std::uint32_t hits =
+                lanes.take(static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero))));
+            if (hits != 0)
+            {
+                return count - 32 + static_cast<std::size_t>(31 - __builtin_clz(hits));
+            }
+        }
+        return count > lanes.pending() ? walk_left(cells, count - 1 - lanes.pending(), stride) : NO_ZERO;
+    }
+#endif
+
+    Kernels pick_kernels()
+    {
+#if FFS_SCAN_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return {avx2_right, avx2_left, 32};
+        }
+        return {sse2_right, sse2_left, 16};
+#else
+        return {walk_right<std::uint8_t>, walk_left<std::uint8_t>, 0};
+#endif
+    }
+
+    const Kernels &kernels()
+    {
+        static const Kernels picked = pick_kernels();
+        return picked;
+    }
+} // namespace
+
+std::size_t find_zero_right(const std::uint8_t *cells, std::size_t from, std::size_t end, std::size_t stride)
+{
+    if (from >= end)
+    {
+        return NO_ZERO;
+    }
+    const Kernels &k = kernels();
+    // A stride wider than a vector touches one cell per load anyway
+    return stride <= k.width ? k.right(cells, from, end, stride) : walk_right(cells, from, end, stride);
+}
+
+std::size_t find_zero_left(const std::uint8_t *cells, std::size_t from, std::size_t stride)
+{
+    const Kernels &k = kernels();
+    return stride <= k.width ? k.left(cells, from, stride) : walk_left(cells, from, stride);
+}
+
+std::size_t find_zero_right(const std::uint16_t *cells, std::size_t from, std::size_t end, std::size_t stride)
+{
+    return from < end ? walk_right(cells, from, end, stride) : NO_ZERO;
+}
+
+std::size_t find_zero_left(const std::uint16_t *cells, std::size_t from, std::size_t stride)
+{
+    return walk_left(cells, from, stride);
+}
+
+std::size_t find_zero_right(const std::uint32_t *cells, std::size_t from, std::size_t end, std::size_t stride)
+{
+    return from < end ? walk_right(cells, from, end, stride) : NO_ZERO;
+}
+
+std::size_t find_zero_left(const std::uint32_t *cells, std::size_t from, std::size_t stride)
+{
+    return walk_left(cells, from, stride);
+}
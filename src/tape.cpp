@@ -0,0 +1,397 @@
+#include "tape.h"
+
+#include "error.h"
+#include "scan.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FFS_TAPE_RESERVE 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define FFS_TAPE_RESERVE 0
+#endif
+
+namespace
+{
+#if FFS_TAPE_RESERVE
+    std::size_t page_size()
+    {
+        static const std::size_t size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        return size;
+    }
+
+    std::size_t round_up(std::size_t n, std::size_t to)
+    {
+        return (n + to - 1) / to * to;
+    }
+
+    constexpr int RESERVE_FLAGS = MAP_PRIVATE | MAP_ANONYMOUS
+#ifdef MAP_NORESERVE
+                                  | MAP_NORESERVE
+#endif
+        ;
+
+    constexpr std::size_t LARGE_RESET = 1024 * 1024;
+
+    // Hand pages back to the kernel; they read as zero if committed again
+    bool release(std::uint8_t *at, std::size_t len)
+    {
+        return len == 0 || mmap(at, len, PROT_NONE, RESERVE_FLAGS | MAP_FIXED, -1, 0) != MAP_FAILED;
+    }
+#endif
+}
+
+Tape::Tape(std::size_t cells, std::size_t maxCells, bool elastic, bool strict, int cellBits)
+    : cellSize(cellBits >= 32 ? 4 : cellBits >= 16 ? 2 : 1), length(cells > 0 ? cells : 30000),
+      maxCells(std::max(maxCells, length)), elastic(elastic), strict(strict), initialLength(length)
+{
+#if FFS_TAPE_RESERVE
+    // Elastic tapes get room for the full limit on either side of the
+    // starting window; fixed tapes just need their own cells
+    std::size_t limit = elastic ? this->maxCells : length;
+    std::size_t side = limit <= SIZE_MAX / 4 ? round_up(limit * cellSize, page_size()) : SIZE_MAX;
+    if (side <= SIZE_MAX / 2)
+    {
+        std::size_t size = elastic ? 2 * side : side;
+        void *mem = mmap(nullptr, size, PROT_NONE, RESERVE_FLAGS, -1, 0);
+        if (mem != MAP_FAILED)
+        {
+            region = static_cast<std::uint8_t *>(mem);
+            regionSize = size;
+            start = initialStart = elastic ? side : 0;
+            committedLo = committedHi = start;
+            commit(start, start + length * cellSize);
+            this->cells = region + start;
+            return;
+        }
+    }
+#endif
+    fallback.assign(length * cellSize, 0);
+    this->cells = fallback.data();
+}
+
+void Tape::reset()
+{
+    length = initialLength;
+    origin = 0;
+    unused = true;
+#if FFS_TAPE_RESERVE
+    if (region)
+    {
+        start = initialStart;
+        cells = region + start;
+        // Growth is given back to the kernel; the starting window is
+        // cleared in place (with its page-rounding slack, so cells grown
+        // into later start at zero too)
+        std::size_t lo = start;
+        std::size_t hi = std::min(regionSize, round_up(start + length * cellSize, page_size()));
+        if (release(region + committedLo, lo - committedLo))
+        {
+            committedLo = lo;
+        }
+        if (release(region + hi, committedHi - hi))
+        {
+            committedHi = hi;
+        }
+#ifdef __linux__
+        // Big tapes are cheaper to drop than to clear; private anonymous
+        // pages read back as zero after MADV_DONTNEED
+        if (committedHi - committedLo >= LARGE_RESET &&
+            madvise(region + committedLo, committedHi - committedLo, MADV_DONTNEED) == 0)
+        {
+            return;
+        }
+#endif
+        std::fill(region + committedLo, region + committedHi, 0);
+        return;
+    }
+#endif
+    fallback.assign(length * cellSize, 0);
+    cells = fallback.data();
+}
+
+bool Tape::restore(std::size_t count, std::size_t home)
+{
+    if (home >= count || count > maxCells || (!elastic && (count != initialLength || home != 0)))
+    {
+        return false;
+    }
+    reset();
+    unused = false;
+    if (!elastic)
+    {
+        return true;
+    }
+    // The reservation has maxCells on either side of the starting window,
+    // so any layout within the limit fits
+    if (region)
+    {
+        std::size_t lo = start - home * cellSize;
+        commit(lo, lo + count * cellSize);
+        start = lo;
+        cells = region + start;
+    }
+    else
+    {
+        fallback.assign(count * cellSize, 0);
+        cells = fallback.data();
+    }
+    length = count;
+    origin = home;
+    return true;
+}
+
+Tape::~Tape()
+{
+#if FFS_TAPE_RESERVE
+    if (region)
+    {
+        munmap(region, regionSize);
+    }
+#endif
+}
+
+void Tape::commit(std::size_t from, std::size_t to)
+{
+#if FFS_TAPE_RESERVE
+    // Pages come back zeroed from the kernel, so newly committed cells need
+    // no clearing and untouched ones never take physical memory
+    std::size_t lo = from / page_size() * page_size();
+    std::size_t hi = std::min(regionSize, round_up(to, page_size()));
+    bool ok = true;
+    if (lo < committedLo)
+    {
+        ok = mprotect(region + lo, committedLo - lo, PROT_READ | PROT_WRITE) == 0;
+        committedLo = ok ? lo : committedLo;
+    }
+    if (ok && hi > committedHi)
+    {
+        ok = mprotect(region + committedHi, hi - committedHi, PROT_READ | PROT_WRITE) == 0;
+        committedHi = ok ? hi : committedHi;
+    }
+    if (!ok)
+    {
+        ffs::ErrorReporter::runtimeError(ffs::ErrorCode::MEMORY_LIMIT_EXCEEDED,
+                                         "Out of memory while growing the tape",
+                                         "Current memory usage: " + std::to_string(length) + " cells",
+                                         "Lower --max-cells or use fewer cells");
+    }
+#else
+    (void)from;
+    (void)to;
+#endif
+}
+
+void Tape::limitExceeded() const
+{
+    ffs::ErrorReporter::runtimeError(ffs::ErrorCode::MEMORY_LIMIT_EXCEEDED,
+                                     "Memory limit of " + std::to_string(maxCells) + " cells exceeded",
+                                     "Current memory usage: " + std::to_string(length) + " cells",
+                                     "Raise --max-cells, use fewer cells or optimize your program");
+}
+
+void Tape::growRight()
+{
+    if (length >= maxCells)
+    {
+        limitExceeded();
+    }
+    std::size_t newLength = std::min(maxCells, std::max(length * 2, length + 1));
+    if (region)
+    {
+        commit(start + length * cellSize, start + newLength * cellSize);
+    }
+    else
+    {
+        fallback.resize(newLength * cellSize, 0);
+        cells = fallback.data();
+    }
+    length = newLength;
+}
+
+void Tape::growLeft(std::size_t &ptr)
+{
+    if (length >= maxCells)
+    {
+        limitExceeded();
+    }
+    std::size_t grow = std::min(maxCells - length, std::max<std::size_t>(length, 1));
+    if (region)
+    {
+        commit(start - grow * cellSize, start);
+        start -= grow * cellSize;
+        cells = region + start;
+    }
+    else
+    {
+        fallback.insert(fallback.begin(), grow * cellSize, 0);
+        cells = fallback.data();
+    }
+    length += grow;
+    origin += grow;
+    ptr += grow;
+}
+
+void Tape::edgeRight(std::size_t &ptr, std::size_t n)
+{
+    if (elastic)
+    {
+        while (n >= length - ptr)
+        {
+            growRight();
+        }
+        ptr += n;
+        return;
+    }
+    if (strict)
+    {
+        ffs::ErrorReporter::runtimeError(ffs::ErrorCode::POINTER_OVERFLOW,
+                                         "Pointer moved beyond available memory",
+                                         "Attempted to access position " + std::to_string(position(length - 1)),
+                                         "Use '<' to move the pointer back or ensure adequate memory");
+    }
+    // clamp
+    ptr = length - 1;
+}
+
+void Tape::edgeLeft(std::size_t &ptr, std::size_t n)
+{
+    if (elastic)
+    {
+        while (n > ptr)
+        {
+            growLeft(ptr);
+        }
+        ptr -= n;
+        return;
+    }
+    if (strict)
+    {
+        ffs::ErrorReporter::runtimeError(ffs::ErrorCode::POINTER_UNDERFLOW,
+                                         "Pointer moved below zero",
+                                         "Attempted to access negative position " + std::to_string(position(0)),
+                                         "Use '>' to move the pointer forward or check your pointer movements");
+    }
+    // clamp
+    ptr = 0;
+}
+
+std::size_t Tape::resolve(std::size_t &ptr, long long offset)
+{
+    long long target = static_cast<long long>(ptr) + offset;
+    while (elastic && target < 0)
+    {
+        std::size_t before = ptr;
+        growLeft(ptr);
+        target += static_cast<long long>(ptr - before);
+    }
+    if (target < 0)
+    {
+        if (strict)
+        {
+            ffs::ErrorReporter::runtimeError(ffs::ErrorCode::POINTER_UNDERFLOW,
+                                             "Loop moved the pointer below zero",
+                                             "Attempted to access negative position " + std::to_string(target - static_cast<long long>(origin)),
+                                             "Use '>' to move the pointer forward or check your pointer movements");
+        }
+        return 0;
+    }
+    while (elastic && static_cast<std::size_t>(target) >= length)
+    {
+        growRight();
+    }
+    if (static_cast<std::size_t>(target) >= length)
+    {
+        if (strict)
+        {
+            ffs::ErrorReporter::runtimeError(ffs::ErrorCode::POINTER_OVERFLOW,
+                                             "Loop moved the pointer beyond available memory",
+                                             "Attempted to access position " + std::to_string(target - static_cast<long long>(origin)),
+                                             "Use '<' to move the pointer back or ensure adequate memory");
+        }
+        return length - 1;
+    }
+    return static_cast<std::size_t>(target);
+}
+
+std::size_t Tape::findZero(std::size_t ptr, int stride) const
+{
+    std::size_t step = stride > 0 ? static_cast<std::size_t>(stride) : 0 - static_cast<std::size_t>(stride);
+    switch (cellSize)
+    {
+    case 1:
+        return stride > 0 ? find_zero_right(cells, ptr, length, step) : find_zero_left(cells, ptr, step);
+    case 2:
+    {
+        const auto *wide = reinterpret_cast<const std::uint16_t *>(cells);
+        return stride > 0 ? find_zero_right(wide, ptr, length, step) : find_zero_left(wide, ptr, step);
+    }
+    default:
+    {
+        const auto *wide = reinterpret_cast<const std::uint32_t *>(cells);
+        return stride > 0 ? find_zero_right(wide, ptr, length, step) : find_zero_left(wide, ptr, step);
+    }
+    }
+}
+
+void Tape::scan(std::size_t &ptr, int stride)
+{
+    while (cell(ptr) != 0)
+    {
+        // Cells already on the tape are searched in bulk; only a scan that
+        // runs off the end is stepped through the edge rules
+        if (stride != 0)
+        {
+            std::size_t step = stride > 0 ? static_cast<std::size_t>(stride) : 0 - static_cast<std::size_t>(stride);
+            std::size_t hit = findZero(ptr, stride);
+            if (hit != NO_ZERO)
+            {
+                ptr = hit;
+                return;
+            }
+            // Last stop before the edge
+            ptr = stride > 0 ? ptr + (length - 1 - ptr) / step * step : ptr % step;
+        }
+        stepOff(ptr, stride);
+    }
+}
+
+void Tape::stepOff(std::size_t &ptr, int stride)
+{
+    long long before = position(ptr);
+    if (stride > 0)
+    {
+        moveRight(ptr, stride);
+    }
+    else
+    {
+        moveLeft(ptr, -stride);
+    }
+    if (position(ptr) == before && cell(ptr) != 0)
+    {
+        ffs::ErrorReporter::runtimeError(ffs::ErrorCode::INTERNAL_ERROR,
+                                         "Infinite loop detected",
+                                         "Scan loop is stuck at the tape edge (position " + std::to_string(position(ptr)) + ")",
+                                         "Check your loop conditions and ensure they can terminate");
+    }
+}
+
+void Tape::dump(FILE *out, std::size_t ptr, int width) const
+{
+    std::size_t left = ptr;
+    std::size_t right = std::min(length, ptr + static_cast<std::size_t>(width));
+    std::fprintf(out, "! ptr=%lld cells=[", position(ptr));
+    for (std::size_t i = left; i < right; ++i)
+    {
+        if (i > left)
+        {
+            std::fputc(' ', out);
+        }
+        std::fprintf(out, "%u", static_cast<unsigned>(cell(i)));
+    }
+    std::fprintf(out, "]\n");
+}
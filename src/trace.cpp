@@ -0,0 +1,310 @@
+#include "trace.h"
+
+#include "error.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FFS_TRACE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define FFS_TRACE_MMAP 0
+#endif
+
+namespace
+{
+    constexpr char MAGIC[4] = {'F', 'F', 'S', 'T'};
+    constexpr std::uint32_t VERSION = 2;
+
+    struct Header
+    {
+        char magic[4];
+        std::uint32_t version;
+        std::uint64_t capacity;
+        std::uint64_t written;
+        std::uint64_t reserved;
+    };
+
+    static_assert(sizeof(Header) == 32, "trace header layout changed");
+
+    // Beyond this a trace file would be several GiB
+    constexpr std::uint64_t MAX_CAPACITY = std::uint64_t(1) << 28;
+
+    std::uint64_t round_capacity(std::size_t capacity)
+    {
+        std::uint64_t n = 1;
+        while (n < capacity && n < MAX_CAPACITY)
+        {
+            n <<= 1;
+        }
+        return n;
+    }
+
+    [[noreturn]] void cannot_write(const std::string &path)
+    {
+        ffs::ErrorInfo error(ffs::ErrorCategory::IO, ffs::ErrorCode::FILE_WRITE_ERROR,
+                             "Could not create trace file: " + path);
+        error.context = "File: " + path;
+        error.suggestion = "Check that the directory is writable, or pass another file with --trace=FILE";
+        throw ffs::Error(error);
+    }
+}
+
+TraceRing::TraceRing(const std::string &path, std::size_t capacity) : path(path)
+{
+    std::uint64_t slotCount = round_capacity(capacity);
+    mask = slotCount - 1;
+#if FFS_TRACE_MMAP
+    // No O_TRUNC: the file is sized exactly below, and truncating it to zero
+    // first would fault anyone else still writing to a mapping of it
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        cannot_write(path);
+    }
+    std::size_t len = sizeof(Header) + slotCount * sizeof(TraceRecord);
+    void *mem = ftruncate(fd, static_cast<off_t>(len)) == 0
+                    ? mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                    : MAP_FAILED;
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        cannot_write(path);
+    }
+    map = mem;
+    mapLen = len;
+    Header *header = static_cast<Header *>(map);
+    *header = Header{{MAGIC[0], MAGIC[1], MAGIC[2], MAGIC[3]}, VERSION, slotCount, 0, 0};
+    written = &header->written;
+    slots = reinterpret_cast<TraceRecord *>(header + 1);
+#else
+    FILE *probe = std::fopen(path.c_str(), "wb");
+    if (probe == nullptr)
+    {
+        cannot_write(path);
+    }
+    std::fclose(probe);
+    written = &count;
+    fallback.resize(slotCount);
+    slots = fallback.data();
+#endif
+}
+
+TraceRing::~TraceRing()
+{
+#if FFS_TRACE_MMAP
+    if (map != nullptr)
+    {
+        munmap(map, mapLen);
+        return;
+    }
+#endif
+    Header header{{MAGIC[0], MAGIC[1], MAGIC[2], MAGIC[3]}, VERSION, mask + 1, count, 0};
+    if (FILE *out = std::fopen(path.c_str(), "wb"))
+    {
+        std::fwrite(&header, sizeof(header), 1, out);
+        std::fwrite(fallback.data(), sizeof(TraceRecord), fallback.size(), out);
+        std::fclose(out);
+    }
+}
+
+namespace
+{
+    struct DumpFilter
+    {
+        std::uint64_t pcLo = 0;
+        std::uint64_t pcHi = UINT64_MAX;
+        int op = -1;
+        std::uint64_t first = 0; // 0 = no limit
+        std::uint64_t last = 0;
+    };
+
+    std::uint64_t parse_count(const std::string &flag, const std::string &val)
+    {
+        try
+        {
+            if (val.empty() || val[0] == '-')
+            {
+                throw std::invalid_argument("negative");
+            }
+            return std::stoull(val);
+        }
+        catch (const std::exception &)
+        {
+            ffs::ErrorReporter::argumentError(ffs::ErrorCode::INVALID_ARGUMENT_VALUE,
+                                              "Invalid value for " + flag + ": " + val,
+                                              "Use a non-negative number, e.g., " + flag + " 100");
+        }
+    }
+
+    std::optional<int> parse_op(const std::string &name)
+    {
+        for (std::size_t op = 0; op < OP_COUNT; ++op)
+        {
+            if (name == op_name(static_cast<Op>(op)))
+            {
+                return static_cast<int>(op);
+            }
+        }
+        return std::nullopt;
+    }
+
+    void print_record(std::uint64_t step, const TraceRecord &r)
+    {
+        const char *name = r.op < OP_COUNT ? op_name(static_cast<Op>(r.op)) : "?";
+        std::printf("step=%llu pc=%u op=%s arg=%d ptr=%lld cell=%u\n",
+                    static_cast<unsigned long long>(step), r.pc, name, r.arg, static_cast<long long>(r.ptr),
+                    static_cast<unsigned>(r.cell));
+    }
+}
+
+int trace_dump(int argc, char **argv)
+{
+    std::string path;
+    DumpFilter filter;
+    for (int i = 0; i < argc; ++i)
+    {
+        std::string a = argv[i];
+        auto needVal = [&]() {
+            if (i + 1 >= argc)
+            {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::MISSING_ARGUMENT_VALUE,
+                                                  "Missing value for " + a,
+                                                  "Run trace-dump --help for the available filters");
+            }
+            return std::string(argv[++i]);
+        };
+        if (a == "--pc")
+        {
+            // A single pc or an inclusive range A-B
+            std::string val = needVal();
+            std::size_t dash = val.find('-');
+            filter.pcLo = parse_count(a, val.substr(0, dash));
+            filter.pcHi = dash == std::string::npos ? filter.pcLo : parse_count(a, val.substr(dash + 1));
+        }
+        else if (a == "--op")
+        {
+            std::string val = needVal();
+            auto op = parse_op(val);
+            if (!op)
+            {
+                ffs::ErrorReporter::argumentError(ffs::ErrorCode::INVALID_ARGUMENT_VALUE,
+                                                  "Unknown op: " + val,
+                                                  "Use an op name as printed by trace-dump, e.g., --op JNZ");
+            }
+            filter.op = *op;
+        }
+        else if (a == "--first")
+        {
+            filter.first = parse_count(a, needVal());
+        }
+        else if (a == "--last")
+        {
+            filter.last = parse_count(a, needVal());
+        }
+        else if (a == "--help" || a == "-h")
+        {
+            std::printf("Usage: FFS trace-dump <file> [--pc N|A-B] [--op NAME] [--first N] [--last N]\n\n"
+                        "Prints the records of a --trace file, oldest first. Filters combine;\n"
+                        "--first and --last count matching records.\n");
+            return 0;
+        }
+        else if (path.empty() && a.rfind("--", 0) != 0)
+        {
+            path = a;
+        }
+        else
+        {
+            ffs::ErrorReporter::argumentError(ffs::ErrorCode::UNKNOWN_ARGUMENT,
+                                              "Unknown trace-dump argument: " + a,
+                                              "Run trace-dump --help for the available filters");
+        }
+    }
+    if (path.empty())
+    {
+        ffs::ErrorReporter::argumentError(ffs::ErrorCode::MISSING_ARGUMENT_VALUE,
+                                          "Missing trace file",
+                                          "Usage: FFS trace-dump ffs.trace");
+    }
+
+    FILE *in = std::fopen(path.c_str(), "rb");
+    if (in == nullptr)
+    {
+        ffs::ErrorReporter::ioError(ffs::ErrorCode::FILE_NOT_FOUND,
+                                    "Could not open trace file: " + path,
+                                    path,
+                                    "Record one first with --trace=" + path);
+    }
+    Header header;
+    bool valid = std::fread(&header, sizeof(header), 1, in) == 1 &&
+                 std::string(header.magic, 4) == std::string(MAGIC, 4) && header.version == VERSION &&
+                 header.capacity > 0 && header.capacity <= MAX_CAPACITY &&
+                 (header.capacity & (header.capacity - 1)) == 0;
+    std::vector<TraceRecord> ring;
+    if (valid)
+    {
+        ring.resize(header.capacity);
+        valid = std::fread(ring.data(), sizeof(TraceRecord), ring.size(), in) == ring.size();
+    }
+    std::fclose(in);
+    if (!valid)
+    {
+        ffs::ErrorReporter::ioError(ffs::ErrorCode::FILE_READ_ERROR,
+                                    "Not a trace file, or it is damaged: " + path,
+                                    path,
+                                    "Record it again with --trace=" + path);
+    }
+
+    // Older records have been overwritten once the ring wrapped
+    std::uint64_t kept = std::min(header.written, header.capacity);
+    std::uint64_t oldest = header.written - kept;
+    auto matches = [&](const TraceRecord &r) {
+        return r.pc >= filter.pcLo && r.pc <= filter.pcHi && (filter.op < 0 || r.op == filter.op);
+    };
+    auto at = [&](std::uint64_t step) -> const TraceRecord & { return ring[step & (header.capacity - 1)]; };
+
+    std::uint64_t from = oldest;
+    if (filter.last > 0)
+    {
+        // Walk back to the start of the last N matches
+        std::uint64_t seen = 0;
+        for (std::uint64_t step = header.written; step > oldest && seen < filter.last; --step)
+        {
+            if (matches(at(step - 1)))
+            {
+                ++seen;
+                from = step - 1;
+            }
+        }
+        if (seen == 0)
+        {
+            from = header.written;
+        }
+    }
+    std::uint64_t printed = 0;
+    for (std::uint64_t step = from; step < header.written; ++step)
+    {
+        if (filter.first > 0 && printed == filter.first)
+        {
+            break;
+        }
+        if (matches(at(step)))
+        {
+            print_record(step + 1, at(step));
+            ++printed;
+        }
+    }
+    if (oldest > 0)
+    {
+        std::fprintf(stderr, "trace-dump: %llu earlier records were overwritten (raise --trace-size)\n",
+                     static_cast<unsigned long long>(oldest));
+    }
+    return 0;
+}
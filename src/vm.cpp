@@ -1,234 +1,478 @@
 #include "vm.h"
 
+#include "budget.h"
+#include "checkpoint.h"
+#include "iobuf.h"
+#include "jit.h"
+#include "profile.h"
+#include "tape.h"
+#include "trace.h"
 #include "util.h"
 #include "error.h"
 
 #include <algorithm>
 #include <cstdint>
 #include <cstdio>
+#include <optional>
+#include <string>
 #include <vector>
 
-int run(const Program &p,
-        int initCells,
-        bool elastic,
-        bool strict,
-        int dbgWidth,
-        bool trace,
-        FILE *fin,
-        FILE *file_out,
-        FILE *file_err)
+// Labels-as-values lets the threaded engine jump straight from one handler
+// to the next; other compilers get the portable switch loop instead
+#if defined(__GNUC__) || defined(__clang__)
+#define FFS_HAS_COMPUTED_GOTO 1
+#else
+#define FFS_HAS_COMPUTED_GOTO 0
+#endif
+
+namespace
 {
-    if (initCells <= 0)
+    // One instantiation per cell type, so the 8-bit engine is compiled
+    // exactly as if no other width existed. ',' stores all ones on EOF.
+    template <typename Cell>
+    class Machine
     {
-        initCells = 30000;
-    }
-    std::vector<std::uint8_t> tape(static_cast<std::size_t>(initCells), 0);
-    std::size_t ptr = 0;
-    constexpr std::size_t MAX_TAPE_SIZE = 1024 * 1024; // 1MB limit
+    public:
+        Machine(const Program &p, const RunOptions &opts, Tape &tape, Budget &budget, InputSource &in, OutputBuffer &out,
+                FILE *file_err, TraceRing *ring, Checkpointer *snapshots, std::size_t entry, std::size_t origin)
+            : p(p), opts(opts), tape(tape), budget(budget), in(in), out(out), file_err(file_err), ring(ring),
+              snapshots(snapshots), entry(entry), origin(origin)
+        {
+        }
 
-    // Infinite loop detection
-    std::uint64_t instructionCount = 0;
-    constexpr std::uint64_t MAX_INSTRUCTIONS = 10000000; // 10 million instructions
+        // Picks the execution loop instantiation matching the options, so
+        // features that are switched off cost nothing per instruction
+        template <bool Threaded>
+        int start();
 
-    auto grow = [&]
+    private:
+        template <bool Threaded, bool Profile>
+        int pick();
+
+        template <bool Threaded, bool Trace, bool Budgeted, bool Profile>
+        int execute();
+
+        static constexpr Cell EOF_VALUE = static_cast<Cell>(~Cell(0));
+
+        const Program &p;
+        const RunOptions &opts;
+        Tape &tape;
+        Budget &budget;
+        InputSource &in;
+        OutputBuffer &out;
+        FILE *file_err;
+        TraceRing *ring;                 // set under --trace
+        Checkpointer *snapshots;         // set under --checkpoint-every
+        std::vector<std::uint64_t> hits; // per-pc counts under --profile
+        std::size_t entry;               // first pc and pointer index of the run
+        std::size_t origin;
+    };
+
+    // Jump targets are checked once up front rather than on every taken jump
+    void validate_jumps(const Program &p)
     {
-        if (tape.size() >= MAX_TAPE_SIZE)
+        for (const auto &ins : p.code)
         {
-            ffs::ErrorReporter::runtimeError(ffs::ErrorCode::MEMORY_LIMIT_EXCEEDED,
-                                             "Memory limit of " + std::to_string(MAX_TAPE_SIZE) + " cells exceeded",
-                                             "Current memory usage: " + std::to_string(tape.size()) + " cells",
-                                             "Consider using fewer cells or optimizing your program");
+            if ((ins.op == Op::JZ || ins.op == Op::JNZ || ins.op == Op::GUARD) &&
+                (ins.arg < 0 || ins.arg >= static_cast<std::int32_t>(p.code.size())))
+            {
+                ffs::ErrorReporter::runtimeError(ffs::ErrorCode::INVALID_JUMP_TARGET,
+                                                 std::string("Invalid jump target in ") + op_name(ins.op) + " instruction",
+                                                 "Jump target: " + std::to_string(ins.arg) + ", program size: " + std::to_string(p.code.size()),
+                                                 "This indicates a compiler bug - please report this issue");
+            }
         }
-        std::size_t newSize = std::min(MAX_TAPE_SIZE, std::max(tape.size() * 2, tape.size() + 1));
-        tape.resize(newSize, 0);
-    };
+    }
 
-    auto cell = [&]() -> std::uint8_t &
-    {
-        return tape[ptr];
-    };
+// Per-instruction bookkeeping; compiled out entirely unless the variant
+// traces, profiles or runs under a budget. The budget itself is only
+// compared against on loop back-edges (see JNZ).
+#define FFS_STEP()                                                      \
+    if constexpr (Budgeted)                                             \
+    {                                                                   \
+        ++count;                                                        \
+    }                                                                   \
+    if constexpr (Trace)                                                \
+    {                                                                   \
+        ring->record(pc, code[pc], tape.position(ptr), mem[ptr]);       \
+    }                                                                   \
+    if constexpr (Profile)                                              \
+    {                                                                   \
+        ++profile[pc];                                                  \
+    }
 
-    auto validateJump = [&](int jumpTarget) -> bool
-    {
-        return jumpTarget >= 0 && jumpTarget < static_cast<int>(p.code.size());
-    };
+#if FFS_HAS_COMPUTED_GOTO
+#define FFS_CASE(name) \
+    case Op::name:     \
+    op_##name:         \
+    if constexpr (Threaded)  \
+    {                  \
+        FFS_STEP();    \
+    }
+#define FFS_NEXT()              \
+    if constexpr (Threaded)     \
+    {                           \
+        ++pc;                   \
+        goto *targets[pc];      \
+    }                           \
+    break
+#else
+#define FFS_CASE(name) case Op::name:
+#define FFS_NEXT() break
+#endif
 
-    for (int pc = 0; pc < static_cast<int>(p.code.size()); ++pc)
+    template <typename Cell>
+    template <bool Threaded, bool Trace, bool Budgeted, bool Profile>
+    int Machine<Cell>::execute()
     {
-        // Check for infinite loop
-        ++instructionCount;
-        if (instructionCount > MAX_INSTRUCTIONS)
+        const Instr *code = p.code.data();
+        const std::size_t size = p.code.size();
+        std::size_t pc = entry;
+        std::size_t ptr = origin;
+        Cell *mem = reinterpret_cast<Cell *>(tape.data());
+        std::size_t length = tape.size();
+        [[maybe_unused]] std::uint64_t count = 0;
+        [[maybe_unused]] std::uint64_t checkpoint = budget.next();
+        [[maybe_unused]] std::uint64_t *profile = hits.data();
+
+        // Only the edge rules can move or resize the tape
+        auto reload = [&]
         {
-            ffs::ErrorReporter::runtimeError(ffs::ErrorCode::INTERNAL_ERROR,
-                                             "Infinite loop detected",
-                                             "Executed " + std::to_string(instructionCount) + " instructions",
-                                             "Check your loop conditions and ensure they can terminate");
-            return 1;
-        }
+            mem = reinterpret_cast<Cell *>(tape.data());
+            length = tape.size();
+        };
+        // The cell an offset-addressed op works on. Offsets that wrap below
+        // zero come out huge, so one compare covers both edges.
+        auto cell = [&](std::int32_t offset)
+        {
+            std::size_t target = ptr + static_cast<std::size_t>(static_cast<std::ptrdiff_t>(offset));
+            if (target >= length)
+            {
+                target = tape.resolve(ptr, offset);
+                reload();
+            }
+            return target;
+        };
+
+#if FFS_HAS_COMPUTED_GOTO
+        // Direct threading: every instruction is translated to its handler's
+        // address once, and a trailing halt slot replaces the pc < size test.
+        // Indexed by Op, with halt last.
+        static const void *const handlers[] = {
+            &&op_INC_PTR, &&op_DEC_PTR, &&op_INC, &&op_DEC, &&op_OUT, &&op_IN, &&op_JZ,
+            &&op_JNZ, &&op_ZERO_IF_EOF, &&op_DBG, &&op_CLEAR, &&op_MUL_ADD, &&op_SCAN, &&op_SET, &&op_GUARD, &&halt};
+        constexpr std::size_t HALT = sizeof(handlers) / sizeof(handlers[0]) - 1;
+        static_assert(HALT == OP_COUNT, "handler table out of sync with Op");
 
-        constexpr std::uint8_t EOF_VALUE = 255;
-        const auto &ins = p.code[pc];
-        if (trace)
+        std::vector<const void *> targets;
+        if constexpr (Threaded)
         {
-            std::fprintf(file_err,
-                         "pc=%d op=%d arg=%d ptr=%zu cell=%u (count=%llu)\n",
-                         pc,
-                         static_cast<int>(ins.op),
-                         ins.arg,
-                         ptr,
-                         static_cast<unsigned>(cell()),
-                         instructionCount);
+            targets.reserve(size + 1);
+            for (const auto &ins : p.code)
+            {
+                targets.push_back(handlers[static_cast<std::size_t>(ins.op)]);
+            }
+            targets.push_back(handlers[HALT]);
+            goto *targets[pc];
         }
-        switch (ins.op)
+#endif
+
+        for (; pc < size; ++pc)
         {
-        case Op::INC_PTR:
-            for (int n = 0; n < ins.arg; ++n)
+            FFS_STEP();
+            switch (code[pc].op)
+            {
+            FFS_CASE(INC_PTR)
+            {
+                tape.moveRight(ptr, code[pc].arg);
+                reload();
+                FFS_NEXT();
+            }
+            FFS_CASE(DEC_PTR)
+            {
+                tape.moveLeft(ptr, code[pc].arg);
+                reload();
+                FFS_NEXT();
+            }
+            FFS_CASE(INC)
+            {
+                std::size_t at = cell(code[pc].offset);
+                mem[at] = static_cast<Cell>(mem[at] + static_cast<Cell>(code[pc].arg));
+                FFS_NEXT();
+            }
+            FFS_CASE(DEC)
+            {
+                std::size_t at = cell(code[pc].offset);
+                mem[at] = static_cast<Cell>(mem[at] - static_cast<Cell>(code[pc].arg));
+                FFS_NEXT();
+            }
+            FFS_CASE(OUT)
             {
-                if (ptr >= tape.size() - 1)
+                out.put(static_cast<std::uint8_t>(mem[cell(code[pc].offset)]), code[pc].arg);
+                FFS_NEXT();
+            }
+            FFS_CASE(IN)
+            {
+                std::size_t at = cell(code[pc].offset);
+                // Prompts must be visible before ',' blocks on a terminal
+                if (in.interactive())
                 {
-                    if (elastic)
-                    {
-                        grow();
-                        if (ptr < tape.size() - 1)
-                        {
-                            ++ptr;
-                        }
-                        else if (strict)
-                        {
-                            ffs::ErrorReporter::runtimeError(ffs::ErrorCode::POINTER_OVERFLOW,
-                                                             "Pointer overflow after memory growth",
-                                                             "Attempted to access position " + std::to_string(
-                                                                                                   ptr + tape.size()),
-                                                             "Ensure your pointer movements don't exceed available memory");
-                        }
-                    }
-                    else if (strict)
-                    {
-                        ffs::ErrorReporter::runtimeError(ffs::ErrorCode::POINTER_OVERFLOW,
-                                                         "Pointer moved beyond available memory",
-                                                         "Attempted to access position " + std::to_string(ptr),
-                                                         "Use '<' to move the pointer back or ensure adequate memory");
-                    }
-                    else
-                    {
-                        // clamp - do nothing
-                    }
+                    out.flush();
                 }
-                else
+                int ch = in.get(code[pc].arg);
+                mem[at] = ch == EOF ? EOF_VALUE : static_cast<Cell>(ch);
+                FFS_NEXT();
+            }
+            FFS_CASE(JZ)
+            {
+                if (mem[ptr] == 0)
                 {
-                    ++ptr;
+                    pc = static_cast<std::size_t>(code[pc].arg);
                 }
+                FFS_NEXT();
             }
-            break;
-        case Op::DEC_PTR:
-            for (int n = 0; n < ins.arg; ++n)
+            FFS_CASE(JNZ)
             {
-                if (ptr == 0)
+                if (mem[ptr] != 0)
                 {
-                    if (strict)
+                    pc = static_cast<std::size_t>(code[pc].arg);
+                    // Every unbounded run passes through here, so this is
+                    // the only place the budget needs looking at
+                    if constexpr (Budgeted)
                     {
-                        ffs::ErrorReporter::runtimeError(ffs::ErrorCode::POINTER_UNDERFLOW,
-                                                         "Pointer moved below zero",
-                                                         "Attempted to access negative position " + std::to_string(
-                                                                                                        ptr),
-                                                         "Use '>' to move the pointer forward or check your pointer movements");
+                        if (count > checkpoint)
+                        {
+                            // Resuming at the loop body's first op skips
+                            // nothing: the cell was just seen nonzero
+                            if (budget.check(count) && snapshots != nullptr)
+                            {
+                                snapshots->take(pc + 1, ptr, tape, in, out);
+                            }
+                            checkpoint = budget.next();
+                        }
                     }
-                    // clamp
-                }
-                else
-                {
-                    --ptr;
                 }
+                FFS_NEXT();
             }
-            break;
-        case Op::INC:
-            cell() = static_cast<std::uint8_t>((cell() + ins.arg) & 0xFF);
-            break;
-        case Op::DEC:
-            // Handle potential underflow properly by ensuring we stay in uint8_t range
-            if (ins.arg <= static_cast<int>(cell()))
+            FFS_CASE(ZERO_IF_EOF)
             {
-                cell() = static_cast<std::uint8_t>(cell() - ins.arg);
+                std::size_t at = cell(code[pc].offset);
+                if (mem[at] == EOF_VALUE)
+                {
+                    mem[at] = 0;
+                }
+                FFS_NEXT();
             }
-            else
+            FFS_CASE(DBG)
             {
-                // Wrap around (standard behavior)
-                cell() = static_cast<std::uint8_t>(256 + static_cast<int>(cell()) - ins.arg);
+                tape.dump(file_err, ptr, opts.dbgWidth);
+                FFS_NEXT();
             }
-            break;
-        case Op::OUT:
-            for (int n = 0; n < ins.arg; ++n)
+            FFS_CASE(CLEAR)
             {
-                std::fputc(cell(), file_out);
+                mem[ptr] = 0;
+                FFS_NEXT();
             }
-            break;
-        case Op::IN:
-            for (int n = 0; n < ins.arg; ++n)
+            FFS_CASE(MUL_ADD)
             {
-                int ch = std::fgetc(fin);
-                if (ch == EOF)
+                if (mem[ptr] != 0)
                 {
-                    cell() = EOF_VALUE;
-                }
-                else
-                {
-                    cell() = static_cast<std::uint8_t>(ch & 0xFF);
+                    // Unsigned, so a 16-bit product cannot overflow int
+                    std::uint32_t factor = mem[ptr];
+                    std::size_t target = cell(code[pc].offset);
+                    mem[target] = static_cast<Cell>(mem[target] + factor * static_cast<std::uint32_t>(code[pc].arg));
                 }
+                FFS_NEXT();
             }
-            break;
-        case Op::JZ:
-            if (cell() == 0)
+            FFS_CASE(SCAN)
             {
-                if (!validateJump(ins.arg))
-                {
-                    ffs::ErrorReporter::runtimeError(ffs::ErrorCode::INVALID_JUMP_TARGET,
-                                                     "Invalid jump target in JZ instruction",
-                                                     "Jump target: " + std::to_string(ins.arg) + ", program size: " + std::to_string(p.code.size()),
-                                                     "This indicates a compiler bug - please report this issue");
-                }
-                pc = ins.arg;
+                tape.scan(ptr, code[pc].arg);
+                reload();
+                FFS_NEXT();
+            }
+            FFS_CASE(SET)
+            {
+                mem[ptr] = static_cast<Cell>(code[pc].arg);
+                FFS_NEXT();
             }
-            break;
-        case Op::JNZ:
-            if (cell() != 0)
+            FFS_CASE(GUARD)
             {
-                if (!validateJump(ins.arg))
+                // Lands on the JZ of the loop as written, one before the
+                // increment FFS_NEXT() applies
+                if (ptr + static_cast<std::size_t>(static_cast<std::ptrdiff_t>(code[pc].offset)) >= length)
                 {
-                    ffs::ErrorReporter::runtimeError(ffs::ErrorCode::INVALID_JUMP_TARGET,
-                                                     "Invalid jump target in JNZ instruction",
-                                                     "Jump target: " + std::to_string(ins.arg) + ", program size: " + std::to_string(p.code.size()),
-                                                     "This indicates a compiler bug - please report this issue");
+                    pc = static_cast<std::size_t>(code[pc].arg) - 1;
                 }
-                pc = ins.arg;
+                FFS_NEXT();
             }
-            break;
-        case Op::ZERO_IF_EOF:
-            if (cell() == EOF_VALUE)
-            {
-                cell() = 0;
             }
-            break;
-        case Op::DBG:
+        }
+
+#if FFS_HAS_COMPUTED_GOTO
+    halt:
+#endif
+        if constexpr (Budgeted)
+        {
+            budget.finish(count);
+        }
+        return 0;
+    }
+
+#undef FFS_CASE
+#undef FFS_NEXT
+#undef FFS_STEP
+
+    template <typename Cell>
+    template <bool Threaded, bool Profile>
+    int Machine<Cell>::pick()
+    {
+        const bool budgeted = budget.enabled();
+        if (opts.trace)
+        {
+            return budgeted ? execute<Threaded, true, true, Profile>() : execute<Threaded, true, false, Profile>();
+        }
+        return budgeted ? execute<Threaded, false, true, Profile>() : execute<Threaded, false, false, Profile>();
+    }
+
+    template <typename Cell>
+    template <bool Threaded>
+    int Machine<Cell>::start()
+    {
+        if (!opts.profile)
+        {
+            return pick<Threaded, false>();
+        }
+        // The report is most wanted when a run is cut short, so it is
+        // written on the way out either way
+        hits.assign(p.code.size(), 0);
+        try
         {
-            std::size_t left = ptr;
-            std::size_t right = std::min(tape.size(), ptr + static_cast<std::size_t>(dbgWidth));
-            std::fprintf(file_err, "! ptr=%zu cells=[", ptr);
-            for (std::size_t i = left; i < right; ++i)
+            int status = pick<Threaded, true>();
+            write_profile(p, hits, file_err, opts.profileOut);
+            return status;
+        }
+        catch (...)
+        {
+            write_profile(p, hits, file_err, opts.profileOut);
+            throw;
+        }
+    }
+
+    template <typename Cell>
+    int interpret(const Program &p, const RunOptions &opts, Tape &tape, Budget &budget, InputSource &in,
+                  OutputBuffer &out, FILE *file_err, std::size_t entry, std::size_t ptr)
+    {
+        std::optional<Checkpointer> snapshots;
+        if (opts.checkpointSteps != 0 || opts.checkpointSeconds > 0)
+        {
+            snapshots.emplace(p, opts.checkpointOut);
+        }
+
+        // Records go straight into a mapped file, so even a run that is killed
+        // part-way leaves its last steps behind
+        std::optional<TraceRing> ring;
+        if (opts.trace)
+        {
+            ring.emplace(opts.traceOut, opts.traceSize);
+        }
+
+        Machine<Cell> machine(p, opts, tape, budget, in, out, file_err, ring ? &*ring : nullptr,
+                              snapshots ? &*snapshots : nullptr, entry, ptr);
+#if FFS_HAS_COMPUTED_GOTO
+        if (opts.engine != Engine::SWITCH)
+        {
+            return machine.template start<true>();
+        }
+#endif
+        return machine.template start<false>();
+    }
+
+    // Start from the compile-time prefix when its state is what this run
+    // would reach anyway: a fresh tape long enough for everything the
+    // prefix touched. Traced, profiled, step-limited and checkpointed runs
+    // see every step instead.
+    // Returns the pc to begin at; the pointer index goes to `ptr`.
+    std::size_t apply_prefix(const Program &p, const RunOptions &opts, Tape &tape, OutputBuffer &out, std::size_t &ptr)
+    {
+        const Prefix &pre = p.prefix;
+        ptr = tape.home();
+        if (pre.entry == 0 || opts.trace || opts.profile || opts.maxSteps != 0 || opts.checkpointSteps != 0 ||
+            opts.checkpointSeconds > 0 || !tape.fresh() || pre.span > tape.size() - tape.home())
+        {
+            return 0;
+        }
+        for (std::size_t i = 0; i < pre.cells.size(); ++i)
+        {
+            tape.setCell(tape.home() + i, pre.cells[i]);
+        }
+        for (char ch : pre.output)
+        {
+            out.put(static_cast<std::uint8_t>(ch), 1);
+        }
+        ptr += pre.ptr;
+        return pre.entry;
+    }
+
+    // Carry on from a --checkpoint-every snapshot: its tape, and the input
+    // and output streams wound forward to where it was taken
+    std::size_t apply_resume(const Program &p, const RunOptions &opts, Tape &tape, InputSource &in, OutputBuffer &out,
+                             std::size_t &ptr)
+    {
+        Resume resume = load_checkpoint(opts.resumeFrom, p, tape);
+        in.skip(resume.input);
+        out.resumeAt(resume.origin, resume.output);
+        ptr = resume.ptr;
+        return resume.pc;
+    }
+
+    int run_engine(const Program &p, const RunOptions &opts, Tape &tape, Budget &budget, InputSource &in,
+                   OutputBuffer &out, FILE *file_err)
+    {
+        std::size_t ptr = 0;
+        std::size_t entry = opts.resumeFrom.empty() ? apply_prefix(p, opts, tape, out, ptr)
+                                                    : apply_resume(p, opts, tape, in, out, ptr);
+        tape.markUsed();
+
+        // Generated code works on byte cells only, and cannot stop for a
+        // snapshot
+        const bool snapshots = opts.checkpointSteps != 0 || opts.checkpointSeconds > 0;
+        if (opts.engine == Engine::JIT && !opts.trace && !opts.profile && !snapshots && tape.cellBits() == 8 &&
+            jit_supported())
+        {
+            if (auto status = run_jit(p, opts, tape, budget, in, out, file_err, entry, ptr))
             {
-                if (i > left)
-                {
-                    std::fputc(' ', file_err);
-                }
-                std::fprintf(file_err, "%u", static_cast<unsigned>(tape[i]));
+                return *status;
             }
-            std::fprintf(file_err, "]\n");
-            break;
         }
-        case Op::CLEAR:
-            cell() = 0;
-            break;
+
+        switch (tape.cellBits())
+        {
+        case 16:
+            return interpret<std::uint16_t>(p, opts, tape, budget, in, out, file_err, entry, ptr);
+        case 32:
+            return interpret<std::uint32_t>(p, opts, tape, budget, in, out, file_err, entry, ptr);
+        default:
+            return interpret<std::uint8_t>(p, opts, tape, budget, in, out, file_err, entry, ptr);
         }
     }
+} // namespace
 
-    return 0;
+int execute(const Program &p, const RunOptions &opts, Tape &tape, InputSource &in, OutputBuffer &out, FILE *file_err,
+            std::uint64_t *steps)
+{
+    if (p.cellBits != tape.cellBits())
+    {
+        ffs::ErrorReporter::runtimeError(ffs::ErrorCode::INVALID_ARGUMENT_VALUE,
+                                         "Program was compiled for " + std::to_string(p.cellBits) + "-bit cells",
+                                         "The tape has " + std::to_string(tape.cellBits()) + "-bit cells",
+                                         "Run it with --cell-bits " + std::to_string(p.cellBits) + " or recompile it");
+    }
+    Budget budget(opts.maxSteps, opts.timeout, opts.checkpointSteps, opts.checkpointSeconds);
+    validate_jumps(p);
+    int status = run_engine(p, opts, tape, budget, in, out, file_err);
+    if (steps != nullptr)
+    {
+        *steps = budget.used();
+    }
+    return status;
 }